@@ -1,15 +1,32 @@
 #include "pch.h"
 #include "CppUnitTest.h"
-#include "../Robot_4/pktDef.h"
+#include "../Robot_4/PktDef.h"
 #include "../Robot_4/MySocket.h"
+#include "../Robot_4/TeleCommand.h"
+#include "../Robot_4/MpscQueue.h"
+#include "../Robot_4/LatencyStats.h"
+#include "../Robot_4/HostResolver.h"
+#include "../Robot_4/CommandScheduler.h"
+#include "../Robot_4/HeartbeatMonitor.h"
+#include "../Robot_4/RobotStandIn.h"
+#include "../Robot_4/RateLimiter.h"
+#include "../Robot_4/RobotDiscovery.h"
+#include "../Robot_4/TelemetryRollup.h"
+#include "../Robot_4/TelemetryStream.h"
+#include "../Robot_4/Tracing.h"
+#include "../Robot_4/PacketCapture.h"
+#include <thread>
+#include <vector>
 #include <memory>
+#include <future>
+#include <climits>
 
 using namespace Microsoft::VisualStudio::CppUnitTestFramework;
 using namespace std;
 
 namespace Microsoft { namespace VisualStudio { namespace CppUnitTestFramework {
     template<>
-    static std::wstring ToString<SocketType>(const SocketType& t) {
+    std::wstring ToString<SocketType>(const SocketType& t) {
         switch (t) {
             case CLIENT: return L"CLIENT";
             case SERVER: return L"SERVER";
@@ -210,12 +227,167 @@ namespace Robot4Test
             PktDef packet;
             packet.SetPktCount(5);
             packet.SetCmd(PktDef::SLEEP); // No body data
+            packet.CalcCRC();
 
             char* raw = packet.GenPacket();
 
             Assert::IsTrue(packet.CheckCRC(raw, HEADERSIZE + 1)); // No body = just header + CRC
         }
 
+        TEST_METHOD(TestHeaderWireLayout)
+        {
+            PktDef packet;
+            packet.SetPktCount(0x1234);
+            packet.SetCmd(PktDef::SLEEP);
+
+            // explicit little endian count, Sleep flag in bit 2, zero length
+            unsigned char* raw = (unsigned char*)packet.GenPacket();
+            Assert::AreEqual(0x34, (int)raw[0]);
+            Assert::AreEqual(0x12, (int)raw[1]);
+            Assert::AreEqual(0x04, (int)raw[2]);
+            Assert::AreEqual(0, (int)raw[3]);
+        }
+
+        TEST_METHOD(TestTelemetryCodec)
+        {
+            Telemetry telem = { 0x0102, 300, 7, FORWARD, 5, 80 };
+            char body[TELEMSIZE];
+            PktDef::EncodeTelemetry(telem, body);
+
+            Assert::AreEqual(0x02, (int)(unsigned char)body[0]);
+            Assert::AreEqual(0x01, (int)(unsigned char)body[1]);
+
+            Telemetry decoded = PktDef::DecodeTelemetry(body);
+            Assert::AreEqual(0x0102, (int)decoded.LastPktCounter);
+            Assert::AreEqual(300, (int)decoded.CurrentGrade);
+            Assert::AreEqual(7, (int)decoded.HitCount);
+            Assert::AreEqual((int)FORWARD, (int)decoded.LastCmd);
+            Assert::AreEqual(5, (int)decoded.LastCmdValue);
+            Assert::AreEqual(80, (int)decoded.LastCmdSpeed);
+        }
+
+        // byte for byte what the original encoder (raw struct copies, CRC over the
+        // Drive body or the sizeof(TELEMETRY) Ack body) put on the wire
+        TEST_METHOD(TestWireFormatFixtures)
+        {
+            const unsigned char driveWire[] = { 0x34, 0x12, 0x01, 0x03, 0x01, 0x0A, 0x50, 0x0D };
+            const unsigned char sleepWire[] = { 0x35, 0x12, 0x04, 0x00, 0x07 };
+            const unsigned char requestWire[] = { 0x36, 0x12, 0x08, 0x00, 0x07 };
+            const unsigned char telemetryWire[] = { 0x36, 0x12, 0x08, 0x0A, 0x36, 0x12, 0x2C, 0x01, 0x07, 0x00, 0x01, 0x0A, 0x50, 0x00, 0x1B };
+
+            PktDef drive;
+            drive.SetCmd(PktDef::DRIVE);
+            drive.SetPktCount(0x1234);
+            DriveBody body = { FORWARD, 10, 80 };
+            drive.SetBodyData((char*)&body, DRIVEBODYSIZE);
+            drive.CalcCRC();
+            Assert::AreEqual(0, memcmp(driveWire, drive.GenPacket(), sizeof(driveWire)));
+
+            PktDef sleep;
+            sleep.SetCmd(PktDef::SLEEP);
+            sleep.SetPktCount(0x1235);
+            sleep.CalcCRC();
+            Assert::AreEqual(0, memcmp(sleepWire, sleep.GenPacket(), sizeof(sleepWire)));
+
+            PktDef request;
+            request.SetCmd(PktDef::RESPONSE);
+            request.SetPktCount(0x1236);
+            request.CalcCRC();
+            Assert::AreEqual(0, memcmp(requestWire, request.GenPacket(), sizeof(requestWire)));
+
+            PktDef telemetry;
+            telemetry.SetCmd(PktDef::RESPONSE);
+            telemetry.SetPktCount(0x1236);
+            char telem[TELEMSIZE];
+            PktDef::EncodeTelemetry(Telemetry{ 0x1236, 300, 7, FORWARD, 10, 80 }, telem);
+            telemetry.SetBodyData(telem, TELEMSIZE);
+            telemetry.CalcCRC();
+            Assert::AreEqual((int)sizeof(telemetryWire), HEADERSIZE + telemetry.GetLength() + (int)CRCSIZE);
+            Assert::AreEqual(0, memcmp(telemetryWire, telemetry.GenPacket(), sizeof(telemetryWire)));
+
+            PktDef received((const char*)telemetryWire, sizeof(telemetryWire));
+            Assert::IsTrue(received.CheckCRC((char*)telemetryWire, sizeof(telemetryWire)));
+            Assert::AreEqual(300, (int)PktDef::DecodeTelemetry(received.GetBodyData()).CurrentGrade);
+        }
+
+        TEST_METHOD(TestMoveConstructor)
+        {
+            PktDef packet;
+            packet.SetPktCount(7);
+            packet.SetCmd(PktDef::DRIVE);
+            unsigned char driveData[3] = { LEFT, 2, 50 };
+            packet.SetBodyData((char*)driveData, sizeof(driveData));
+            char* body = packet.GetBodyData();
+
+            PktDef moved(std::move(packet));
+
+            // the body buffer changes owner, it is not copied
+            Assert::IsTrue(moved.GetBodyData() == body);
+            Assert::AreEqual(7, moved.GetPktCount());
+            Assert::AreEqual(3, moved.GetLength());
+            Assert::IsNull(packet.GetBodyData());
+            Assert::AreEqual(0, packet.GetLength());
+        }
+
+        TEST_METHOD(TestClone)
+        {
+            PktDef packet;
+            packet.SetPktCount(8);
+            packet.SetCmd(PktDef::DRIVE);
+            unsigned char driveData[3] = { RIGHT, 4, 70 };
+            packet.SetBodyData((char*)driveData, sizeof(driveData));
+            packet.CalcCRC();
+
+            PktDef copy = packet.Clone();
+
+            Assert::IsFalse(copy.GetBodyData() == packet.GetBodyData());
+            Assert::AreEqual(0, memcmp(copy.GetBodyData(), packet.GetBodyData(), 3));
+            Assert::AreEqual(0, memcmp(copy.GenPacket(), packet.GenPacket(), HEADERSIZE + 3 + 1));
+        }
+
+        TEST_METHOD(TestGetFragments)
+        {
+            PktDef packet;
+            packet.SetPktCount(300);
+            packet.SetCmd(PktDef::DRIVE);
+            unsigned char driveData[3] = { BACKWARD, 9, 40 };
+            packet.SetBodyData((char*)driveData, sizeof(driveData));
+            packet.CalcCRC();
+
+            PktDef::Fragment frags[3];
+            int count = packet.GetFragments(frags);
+            Assert::AreEqual(3, count);
+
+            // fragments laid end to end are exactly the serialized packet
+            string joined;
+            for (int i = 0; i < count; i++) joined.append(frags[i].Data, frags[i].Size);
+            Assert::AreEqual(HEADERSIZE + 3 + 1, (int)joined.size());
+            Assert::AreEqual(0, memcmp(joined.data(), packet.GenPacket(), joined.size()));
+
+            // body fragment points at the packet's own body, no copy
+            Assert::IsTrue(frags[1].Data == packet.GetBodyData());
+        }
+
+        TEST_METHOD(TestSizedConstructor)
+        {
+            PktDef packet;
+            packet.SetPktCount(12);
+            packet.SetCmd(PktDef::DRIVE);
+            unsigned char driveData[3] = { FORWARD, 1, 20 };
+            packet.SetBodyData((char*)driveData, sizeof(driveData));
+            packet.CalcCRC();
+            char* raw = packet.GenPacket();
+
+            PktDef parsed(raw, HEADERSIZE + 3 + 1);
+            Assert::AreEqual(12, parsed.GetPktCount());
+            Assert::AreEqual(3, parsed.GetLength());
+
+            // declared body runs past the buffer: nothing is read
+            PktDef truncated(raw, HEADERSIZE + 2);
+            Assert::AreEqual(0, truncated.GetLength());
+            Assert::IsNull(truncated.GetBodyData());
+        }
+
 
 
     };
@@ -288,13 +460,1099 @@ namespace Robot4Test
             socket.SendData(msg, strlen(msg));
         }
 
+        // scatter-gather send arrives as one datagram
+        TEST_METHOD(SendData_Fragments)
+        {
+            MySocket server(SERVER, "127.0.0.1", 8091, UDP, 128);
+            MySocket client(CLIENT, "127.0.0.1", 8091, UDP, 128);
+
+            char head[] = "ab";
+            char tail[] = "cde";
+            struct iovec frags[2] = { { head, 2 }, { tail, 3 } };
+            client.SendData(frags, 2);
+
+            char recv[128];
+            int bytes = server.GetData(recv);
+            Assert::AreEqual(5, bytes);
+            Assert::AreEqual(0, memcmp("abcde", recv, 5));
+        }
+
+        // receive refuses a datagram larger than the destination
+        TEST_METHOD(GetData_SpanTooSmall)
+        {
+            MySocket server(SERVER, "127.0.0.1", 8092, UDP, 128);
+            MySocket client(CLIENT, "127.0.0.1", 8092, UDP, 128);
+
+            client.SendData("0123456789", 10);
+
+            char small[4];
+            Assert::AreEqual(-1, server.GetData(span<char>(small)));
+        }
+
+        // lent buffers hold the datagram and go back to the pool
+        TEST_METHOD(LendData_ReturnsToPool)
+        {
+            MySocket server(SERVER, "127.0.0.1", 8093, UDP, 128);
+            MySocket client(CLIENT, "127.0.0.1", 8093, UDP, 128);
+
+            client.SendData("hello", 5);
+            int size = 0;
+            char* lent = server.LendData(size);
+            Assert::IsNotNull(lent);
+            Assert::AreEqual(5, size);
+            Assert::AreEqual(0, memcmp("hello", lent, 5));
+            server.ReturnData(lent);
+
+            // the same buffer is lent out again
+            client.SendData("again", 5);
+            Assert::IsTrue(server.LendData(size) == lent);
+            server.ReturnData(lent);
+        }
+
+        // kernel stamps bracket a loopback datagram
+        TEST_METHOD(Timestamps_Loopback)
+        {
+            MySocket server(SERVER, "127.0.0.1", 8094, UDP, 128);
+            MySocket client(CLIENT, "127.0.0.1", 8094, UDP, 128);
+            Assert::IsTrue(client.EnableTimestamps());
+            Assert::IsTrue(server.EnableTimestamps());
+
+            client.SendData("ping", 4);
+            char recv[128];
+            Assert::AreEqual(4, server.GetData(recv));
+
+            struct timespec sent, arrived;
+            Assert::IsTrue(client.GetTxTimestamp(sent));
+            Assert::IsTrue(server.GetRxTimestamp(arrived));
+            double deltaUs = (arrived.tv_sec - sent.tv_sec) * 1e6 + (arrived.tv_nsec - sent.tv_nsec) / 1e3;
+            Assert::IsTrue(deltaUs >= 0 && deltaUs < 1e6);
+        }
+
+        // polling returns 0 until a datagram is waiting, then the datagram
+        TEST_METHOD(TryGetData_Polls)
+        {
+            MySocket server(SERVER, "127.0.0.1", 8095, UDP, 128);
+            MySocket client(CLIENT, "127.0.0.1", 8095, UDP, 128);
+            char recv[128];
+            Assert::AreEqual(0, server.TryGetData(recv, sizeof(recv)));
+
+            client.SendData("ping", 4);
+            int bytes = 0;
+            for (int i = 0; i < 1000 && bytes == 0; i++) {
+                bytes = server.TryGetData(recv, sizeof(recv));
+            }
+            Assert::AreEqual(4, bytes);
+            Assert::AreEqual(0, memcmp("ping", recv, 4));
+        }
+
+        // the socket follows the address family, so IPv6 robots work too
+        TEST_METHOD(SendData_IPv6Loopback)
+        {
+            MySocket server(SERVER, "::1", 8096, UDP, 128);
+            MySocket client(CLIENT, "::1", 8096, UDP, 128);
+            Assert::AreEqual((int)AF_INET6, client.GetFamily());
+
+            client.SendData("ping", 4);
+            char recv[128];
+            Assert::AreEqual(4, server.GetData(recv));
+        }
+
         // test receive data - ideally mocked
         TEST_METHOD(GetData_BufferCopy)
         {
             MySocket socket(CLIENT, "127.0.0.1", 8080, UDP, 128);
+            socket.SetTimeout(100); // an unbound UDP socket blocks on Linux rather than failing
             char recv[128];
             int bytes = socket.GetData(recv); // will return -1 without actual connection
             Assert::IsTrue(bytes <= 128);
         }
     };
+    TEST_CLASS(TeleCommandTests)
+    {
+    public:
+
+        // text drive command
+        TEST_METHOD(Parse_DriveCommand)
+        {
+            TeleCommand cmd;
+            Assert::AreEqual((int)PARSE_OK, (int)ParseTeleCommand("Backward,12", cmd));
+            Assert::AreEqual((int)PktDef::DRIVE, (int)cmd.Cmd);
+            Assert::AreEqual((int)BACKWARD, (int)cmd.Body.Direction);
+            Assert::AreEqual(12, (int)cmd.Body.Duration);
+            Assert::AreEqual(DEFAULT_SPEED, (int)cmd.Body.Speed);
+        }
+
+        // sleep has no arguments
+        TEST_METHOD(Parse_SleepCommand)
+        {
+            TeleCommand cmd;
+            Assert::AreEqual((int)PARSE_OK, (int)ParseTeleCommand("Sleep", cmd));
+            Assert::AreEqual((int)PktDef::SLEEP, (int)cmd.Cmd);
+        }
+
+        // malformed input is rejected instead of throwing
+        TEST_METHOD(Parse_InvalidInput)
+        {
+            TeleCommand cmd;
+            Assert::AreEqual((int)PARSE_MALFORMED, (int)ParseTeleCommand("Forward", cmd));
+            Assert::AreEqual((int)PARSE_BAD_DIRECTION, (int)ParseTeleCommand("Up,5", cmd));
+            Assert::AreEqual((int)PARSE_BAD_DURATION, (int)ParseTeleCommand("Left,abc", cmd));
+            Assert::AreEqual((int)PARSE_BAD_DURATION, (int)ParseTeleCommand("Left,256", cmd));
+            Assert::AreEqual((int)PARSE_BAD_DURATION, (int)ParseTeleCommand("Left,", cmd));
+        }
+
+        // raw DriveBody bytes
+        TEST_METHOD(Parse_BinaryDriveBody)
+        {
+            TeleCommand cmd;
+            const char raw[3] = { RIGHT, 7, 60 };
+            Assert::AreEqual((int)PARSE_OK, (int)ParseDriveBody(string_view(raw, 3), cmd));
+            Assert::AreEqual((int)RIGHT, (int)cmd.Body.Direction);
+            Assert::AreEqual(7, (int)cmd.Body.Duration);
+            Assert::AreEqual(60, (int)cmd.Body.Speed);
+
+            Assert::AreEqual((int)PARSE_MALFORMED, (int)ParseDriveBody(string_view(raw, 2), cmd));
+            const char badDir[3] = { 9, 7, 60 };
+            Assert::AreEqual((int)PARSE_BAD_DIRECTION, (int)ParseDriveBody(string_view(badDir, 3), cmd));
+        }
+    };
+    TEST_CLASS(MpscQueueTests)
+    {
+    public:
+
+        // single producer sees FIFO order
+        TEST_METHOD(PushPop_FifoOrder)
+        {
+            MpscQueue<int> queue;
+            int value = 0;
+            Assert::IsFalse(queue.Pop(value));
+
+            for (int i = 0; i < 5; i++) queue.Push(i);
+            for (int i = 0; i < 5; i++) {
+                Assert::IsTrue(queue.Pop(value));
+                Assert::AreEqual(i, value);
+            }
+            Assert::IsFalse(queue.Pop(value));
+        }
+
+        // concurrent producers lose nothing
+        TEST_METHOD(Push_ManyProducers)
+        {
+            MpscQueue<int> queue;
+            const int producers = 4;
+            const int perProducer = 10000;
+
+            vector<thread> threads;
+            for (int p = 0; p < producers; p++) {
+                threads.emplace_back([&queue, p] {
+                    for (int i = 0; i < perProducer; i++) queue.Push(p * perProducer + i);
+                });
+            }
+
+            vector<int> seen(producers * perProducer, 0);
+            int popped = 0;
+            int value = 0;
+            while (popped < producers * perProducer) {
+                if (queue.Pop(value)) {
+                    seen[value]++;
+                    popped++;
+                }
+            }
+            for (thread& t : threads) t.join();
+
+            for (int count : seen) Assert::AreEqual(1, count);
+            Assert::IsFalse(queue.Pop(value));
+        }
+    };
+    TEST_CLASS(LatencyHistogramTests)
+    {
+    public:
+
+        TEST_METHOD(Empty_ReportsZero)
+        {
+            LatencyHistogram hist;
+            Assert::AreEqual(0, (int)hist.GetCount());
+            Assert::IsTrue(hist.GetPercentile(0.99) == 0.0);
+        }
+
+        // percentiles land within one bucket (25%) of the true value
+        TEST_METHOD(Percentiles_WithinBucket)
+        {
+            LatencyHistogram hist;
+            for (int i = 1; i <= 1000; i++) hist.Record(i);
+
+            Assert::AreEqual(1000, (int)hist.GetCount());
+            Assert::IsTrue(hist.GetMax() == 1000.0);
+            double p50 = hist.GetPercentile(0.50);
+            double p99 = hist.GetPercentile(0.99);
+            Assert::IsTrue(p50 >= 500 && p50 <= 625);
+            Assert::IsTrue(p99 >= 990 && p99 <= 1000);
+            Assert::IsTrue(hist.GetMean() > 499 && hist.GetMean() < 502);
+        }
+
+        // the timeout tightens around a steady round trip and doubles on each timeout
+        TEST_METHOD(RttEstimator_AdaptsAndBacksOff)
+        {
+            RttEstimator rtt(500);
+            Assert::AreEqual(500, rtt.GetRtoMs());
+
+            rtt.Sample(20000);
+            Assert::AreEqual(60, rtt.GetRtoMs());
+            for (int i = 0; i < 50; i++) rtt.Sample(20000);
+            Assert::IsTrue(rtt.GetRtoMs() >= 20 && rtt.GetRtoMs() <= 21);
+
+            double before = rtt.GetRto();
+            rtt.Timeout();
+            Assert::IsTrue(rtt.GetRto() == before * 2);
+            for (int i = 0; i < 20; i++) rtt.Timeout();
+            Assert::AreEqual(RTO_MAX_MS, rtt.GetRtoMs());
+        }
+    };
+
+    TEST_CLASS(HostResolverTests)
+    {
+    public:
+
+        // numeric addresses never reach the lookup thread
+        TEST_METHOD(Numeric_PassesThrough)
+        {
+            HostResolver resolver;
+            vector<string> addrs;
+            Assert::IsTrue(resolver.GetCached("fe80::1", addrs));
+            Assert::AreEqual(string("fe80::1"), addrs[0]);
+        }
+
+        // a name is looked up once, then served from the cache
+        TEST_METHOD(Hostname_Cached)
+        {
+            HostResolver resolver;
+            vector<string> addrs;
+            Assert::IsFalse(resolver.GetCached("localhost", addrs));
+
+            promise<vector<string>> resolved;
+            resolver.Resolve("localhost", [&resolved](const vector<string>& found, const string&) { resolved.set_value(found); });
+            vector<string> found = resolved.get_future().get();
+            Assert::IsFalse(found.empty());
+
+            Assert::IsTrue(resolver.GetCached("localhost", addrs));
+            Assert::IsTrue(addrs == found);
+            Assert::AreEqual(1u, resolver.GetGeneration());
+        }
+    };
+
+    TEST_CLASS(CommandSchedulerTests)
+    {
+    public:
+
+        // steps go out in time order, close to their deadlines
+        TEST_METHOD(Plan_RunsToCompletion)
+        {
+            RobotStandIn robot;
+            shared_ptr<RobotLink> link = make_shared<RobotLink>("127.0.0.1", robot.GetPort());
+            CommandScheduler scheduler;
+
+            vector<PlanStep> steps(2);
+            steps[0].AtMs = 30;
+            steps[0].Cmd.Cmd = PktDef::SLEEP;
+            steps[1].AtMs = 10;
+            Assert::AreEqual((int)PARSE_OK, (int)ParseTeleCommand("Forward,5", steps[1].Cmd));
+            unsigned long id = scheduler.Schedule(link, steps, 10);
+
+            CommandScheduler::PlanProgress progress;
+            Assert::IsTrue(scheduler.GetProgress(id, progress));
+            Assert::AreEqual((int)CommandScheduler::PLAN_PENDING, (int)progress.State);
+
+            this_thread::sleep_for(chrono::milliseconds(200));
+            Assert::IsTrue(scheduler.GetProgress(id, progress));
+            Assert::AreEqual((int)CommandScheduler::PLAN_DONE, (int)progress.State);
+            Assert::AreEqual((size_t)2, progress.Dispatched);
+            Assert::AreEqual(1ul, progress.SleepsAcked);
+            Assert::IsTrue(progress.MaxLateUs < 10000);
+        }
+
+        TEST_METHOD(Cancel_StopsPendingSteps)
+        {
+            RobotStandIn robot;
+            shared_ptr<RobotLink> link = make_shared<RobotLink>("127.0.0.1", robot.GetPort());
+            CommandScheduler scheduler;
+
+            vector<PlanStep> steps(1);
+            steps[0].AtMs = 10000;
+            steps[0].Cmd.Cmd = PktDef::SLEEP;
+            unsigned long id = scheduler.Schedule(link, steps, 0);
+
+            Assert::IsTrue(scheduler.Cancel(id));
+            Assert::IsFalse(scheduler.Cancel(id));
+            CommandScheduler::PlanProgress progress;
+            Assert::IsTrue(scheduler.GetProgress(id, progress));
+            Assert::AreEqual((int)CommandScheduler::PLAN_CANCELLED, (int)progress.State);
+            Assert::AreEqual((size_t)0, progress.Dispatched);
+
+            // the scheduler lets go of the link now, not when the step would have been due
+            weak_ptr<RobotLink> watched = link;
+            link.reset();
+            for (int i = 0; i < 100 && !watched.expired(); i++) this_thread::sleep_for(chrono::milliseconds(5));
+            Assert::IsTrue(watched.expired());
+        }
+    };
+
+    TEST_CLASS(RobotLinkTests)
+    {
+    public:
+
+        // drives queued while the robot is busy collapse into the newest one
+        TEST_METHOD(SubmitDrive_LatestWins)
+        {
+            RobotStandIn robot(0, 30000);
+            RobotLink link("127.0.0.1", robot.GetPort());
+            DriveBody body = { FORWARD, 1, 100 };
+
+            // keep the sender busy so the drives pile up in the slot
+            promise<string> busy;
+            link.SubmitSleep([&busy](const string& reply) { busy.set_value(reply); });
+            this_thread::sleep_for(chrono::milliseconds(5));
+
+            vector<string> replies(4);
+            promise<void> last;
+            for (int i = 0; i < 3; i++) {
+                link.SubmitDrive(body, [&replies, i](const string& reply) { replies[i] = reply; });
+            }
+            link.SubmitDrive(body, [&replies, &last](const string& reply) { replies[3] = reply; last.set_value(); });
+            last.get_future().wait();
+
+            for (int i = 0; i < 3; i++) Assert::AreEqual(string("Superseded"), replies[i]);
+            Assert::AreEqual(0, (int)replies[3].rfind("Robot replied", 0));
+            Assert::AreEqual(4UL, link.GetDrivesSubmitted());
+            Assert::AreEqual(3UL, link.GetDrivesSuperseded());
+            Assert::AreEqual(1UL, link.GetDrivesSent());
+            Assert::AreEqual(2UL, robot.GetReceived());
+        }
+
+        // a drive replaced before it went out is told so; the one sent gets the robot's reply
+        TEST_METHOD(SubmitDrive_RepliesOrSupersedes)
+        {
+            RobotStandIn robot(0, 20000);
+            RobotLink link("127.0.0.1", robot.GetPort());
+            DriveBody body = { FORWARD, 1, 100 };
+
+            // the first drive goes straight out; of the next two, only the last survives
+            promise<string> first, second, third;
+            link.SubmitDrive(body, [&first](const string& reply) { first.set_value(reply); });
+            this_thread::sleep_for(chrono::milliseconds(5));
+            link.SubmitDrive(body, [&second](const string& reply) { second.set_value(reply); });
+            Assert::AreEqual((int)RobotLink::DRIVE_SUPERSEDED, (int)link.SubmitDrive(body, [&third](const string& reply) { third.set_value(reply); }));
+
+            Assert::AreEqual(string("Superseded"), second.get_future().get());
+            Assert::AreEqual(0, (int)first.get_future().get().rfind("Robot replied", 0));
+            Assert::AreEqual(0, (int)third.get_future().get().rfind("Robot replied", 0));
+        }
+
+        // a sleep jumps queued telemetry, waiting at most for the packet on the wire
+        TEST_METHOD(SubmitSleep_PreemptsQueuedWork)
+        {
+            const int delayMs = 50;
+            RobotStandIn robot(0, delayMs * 1000);
+            RobotLink link("127.0.0.1", robot.GetPort());
+            DriveBody body = { FORWARD, 1, 100 };
+
+            mutex lock;
+            vector<string> order;
+            auto answered = [&lock, &order](const string& name) {
+                lock_guard<mutex> guard(lock);
+                order.push_back(name);
+            };
+
+            // one packet on the wire, then a backlog behind it
+            link.SubmitSleep([&](const string&) { answered("first"); });
+            this_thread::sleep_for(chrono::milliseconds(5));
+            atomic<int> superseded(0);
+            for (int i = 0; i < 3; i++) link.SubmitDrive(body, [&](const string& reply) { if (reply == "Superseded") superseded++; else answered("drive"); });
+            promise<void> drained;
+            link.SubmitTelemetry([&](const string&) { answered("telemetry"); drained.set_value(); });
+
+            promise<void> slept;
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            link.SubmitSleep([&](const string&) { answered("sleep"); slept.set_value(); });
+            slept.get_future().wait();
+            long long waitedMs = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+            drained.get_future().wait();
+
+            // the sleep also stops the drives that had not gone out
+            Assert::AreEqual(3, superseded.load());
+            Assert::AreEqual((size_t)3, order.size());
+            Assert::AreEqual(string("first"), order[0]);
+            Assert::AreEqual(string("sleep"), order[1]);
+            Assert::AreEqual(string("telemetry"), order[2]);
+
+            // the rest of the first round trip plus its own; FIFO would be one more
+            Assert::IsTrue(waitedMs < 2 * delayMs + delayMs / 2);
+            RobotLink::LaneStats high = link.GetLaneStats(RobotLink::HIGH);
+            Assert::AreEqual(2UL, high.Count);
+            Assert::IsTrue(high.MaxWaitUs < 2 * delayMs * 1000);
+        }
+
+        // a motion script puts BATCH_WINDOW packets on the wire, then waits for acks
+        TEST_METHOD(SubmitBatch_PipelinesWithinWindow)
+        {
+            RobotStandIn robot;
+            robot.DropReplies(1, ULONG_MAX);
+            RobotLink link("127.0.0.1", robot.GetPort());
+            vector<TeleCommand> steps(BATCH_WINDOW + 4, TeleCommand{ PktDef::DRIVE, { FORWARD, 1, 100 } });
+
+            promise<RobotLink::BatchResult> done;
+            link.SubmitBatch(steps, [&done](const RobotLink::BatchResult& result) { done.set_value(result); });
+            this_thread::sleep_for(chrono::milliseconds(100));
+            Assert::AreEqual((unsigned long)BATCH_WINDOW, robot.GetReceived());
+
+            // the silent window times out and is lost; the rest go out and are acked
+            robot.DropReplies(1, 0);
+            RobotLink::BatchResult result = done.get_future().get();
+            Assert::AreEqual(steps.size(), result.Acked.size());
+            for (size_t i = 0; i < steps.size(); i++) {
+                Assert::AreEqual(i >= BATCH_WINDOW, (bool)result.Acked[i]);
+                Assert::AreEqual((int)(unsigned short)(result.PktCounts[0] + i), (int)result.PktCounts[i]);
+            }
+        }
+
+        // each ack lands on its own step; a dropped reply loses only that step
+        TEST_METHOD(SubmitBatch_DroppedReplyLosesOneStep)
+        {
+            RobotStandIn robot;
+            robot.DropReplies(3, 3);
+            RobotLink link("127.0.0.1", robot.GetPort());
+            vector<TeleCommand> steps(6, TeleCommand{ PktDef::DRIVE, { FORWARD, 1, 100 } });
+            steps[4].Cmd = PktDef::SLEEP;
+
+            promise<RobotLink::BatchResult> done;
+            link.SubmitBatch(steps, [&done](const RobotLink::BatchResult& result) { done.set_value(result); });
+            RobotLink::BatchResult result = done.get_future().get();
+
+            Assert::AreEqual(6UL, robot.GetReceived());
+            for (size_t i = 0; i < steps.size(); i++) {
+                Assert::AreEqual(i != 2, (bool)result.Acked[i]);
+            }
+        }
+
+        // a sleep sent mid-script goes out at the next reply; the steps not yet sent come back preempted
+        TEST_METHOD(SubmitBatch_YieldsToSleep)
+        {
+            const int delayMs = 20;
+            RobotStandIn robot(0, delayMs * 1000);
+            RobotLink link("127.0.0.1", robot.GetPort());
+            vector<TeleCommand> steps(40, TeleCommand{ PktDef::DRIVE, { FORWARD, 1, 100 } });
+
+            promise<RobotLink::BatchResult> done;
+            link.SubmitBatch(steps, [&done](const RobotLink::BatchResult& result) { done.set_value(result); });
+            this_thread::sleep_for(chrono::milliseconds(5 * delayMs));
+
+            promise<string> slept;
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            link.SubmitSleep([&slept](const string& reply) { slept.set_value(reply); });
+            string reply = slept.get_future().get();
+            double waitedMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+            // behind at most the window already on the wire, not the rest of the script
+            Assert::IsTrue(reply.rfind("Robot replied", 0) == 0);
+            Assert::IsTrue(waitedMs < (BATCH_WINDOW + 4) * delayMs);
+
+            RobotLink::BatchResult result = done.get_future().get();
+            size_t preempted = 0;
+            for (size_t i = 0; i < steps.size(); i++) {
+                Assert::IsFalse(result.Acked[i] && result.Preempted[i]);
+                if (result.Preempted[i]) preempted++;
+            }
+            Assert::IsTrue(preempted > 0);
+            Assert::IsTrue(result.Preempted.back());
+            Assert::AreEqual(steps.size() - preempted + 1, (size_t)robot.GetReceived());
+        }
+
+        // concurrent telemetry requests share one round trip and one reply
+        TEST_METHOD(SubmitTelemetry_SingleFlight)
+        {
+            const int callers = 16;
+            RobotStandIn robot(0, 50000);
+            RobotLink link("127.0.0.1", robot.GetPort());
+            unsigned long before = link.GetTelemetryRoundTrips();
+
+            vector<promise<string>> replies(callers);
+            atomic<bool> go(false);
+            vector<thread> threads;
+            for (int i = 0; i < callers; i++) {
+                threads.emplace_back([&, i] {
+                    while (!go) this_thread::yield();
+                    link.SubmitTelemetry([&replies, i](const string& reply) { replies[i].set_value(reply); });
+                });
+            }
+            go = true;
+            for (thread& t : threads) t.join();
+
+            string first = replies[0].get_future().get();
+            Assert::AreEqual('{', first[0]);
+            for (int i = 1; i < callers; i++) Assert::AreEqual(first, replies[i].get_future().get());
+            Assert::AreEqual(before + 1, link.GetTelemetryRoundTrips());
+            Assert::AreEqual((unsigned long)callers, link.GetTelemetryRequests());
+            Assert::AreEqual(1UL, robot.GetReceived());
+        }
+
+        // a backlog on a slow robot trips shedding; it clears once the backlog drains
+        TEST_METHOD(ShouldShed_TracksBacklog)
+        {
+            RobotStandIn robot(0, 100000);
+            RobotLink link("127.0.0.1", robot.GetPort());
+
+            promise<string> first;
+            link.SubmitTelemetry([&first](const string& reply) { first.set_value(reply); });
+            first.get_future().wait();
+            Assert::IsFalse(link.ShouldShed());
+
+            promise<void> drained;
+            atomic<int> left(4);
+            for (int i = 0; i < 4; i++) {
+                link.SubmitSleep([&](const string&) { if (--left == 0) drained.set_value(); });
+            }
+            Assert::IsTrue(link.ShouldShed());
+
+            string cached;
+            long long ageMs;
+            Assert::IsTrue(link.GetCachedTelemetry(cached, ageMs));
+            Assert::AreEqual('{', cached[0]);
+
+            drained.get_future().wait();
+            Assert::IsFalse(link.ShouldShed());
+        }
+
+        // once round trips time out, each queued item counts a whole reply timeout, not the old smoothed rtt
+        TEST_METHOD(ShouldShed_CountsTimeouts)
+        {
+            RobotStandIn robot;
+            RobotLink link("127.0.0.1", robot.GetPort());
+
+            promise<string> answered;
+            link.SubmitTelemetry([&answered](const string& reply) { answered.set_value(reply); });
+            Assert::AreEqual('{', answered.get_future().get()[0]);
+
+            robot.DropReplies(2, ULONG_MAX);
+            for (int i = 0; i < BREAKER_THRESHOLD - 1; i++) {
+                promise<string> lost;
+                link.SubmitTelemetry([&lost](const string& reply) { lost.set_value(reply); });
+                Assert::AreEqual(string("No response"), lost.get_future().get());
+            }
+            Assert::IsFalse(link.ShouldShed());
+
+            // a backlog the fast smoothed rtt would wave through
+            int queued = (int)(SHED_TARGET_US / link.GetRtt().GetRto()) + 1;
+            Assert::IsTrue(queued * link.GetRtt().GetSrtt() < SHED_TARGET_US / 2);
+            for (int i = 0; i < queued; i++) link.SubmitSleep([](const string&) {});
+            Assert::IsTrue(link.ShouldShed());
+        }
+
+        // a late reply to an earlier packet is skipped; the packet's own reply is returned
+        TEST_METHOD(RoundTrip_SkipsStaleReply)
+        {
+            RobotStandIn robot;
+            robot.DelayReply(1, (REPLY_TIMEOUT_MS + 200) * 1000);
+            RobotLink link("127.0.0.1", robot.GetPort());
+
+            promise<string> first, second;
+            link.SubmitTelemetry([&first](const string& reply) { first.set_value(reply); });
+            Assert::AreEqual(string("No response"), first.get_future().get());
+            link.SubmitTelemetry([&second](const string& reply) { second.set_value(reply); });
+
+            // the first packet's reply lands while the second waits; the stand-in echoes counts
+            string reply = second.get_future().get();
+            Assert::AreEqual(0, (int)reply.find("{\"LastPktCounter\":2,"));
+            Assert::AreEqual(2UL, robot.GetReceived());
+        }
+
+        // heartbeats keep a quiet robot alive; once it stops answering it is not
+        TEST_METHOD(Heartbeat_TracksLiveness)
+        {
+            RobotStandIn robot;
+            shared_ptr<RobotLink> link = make_shared<RobotLink>("127.0.0.1", robot.GetPort());
+            Assert::IsFalse(link->IsAlive());
+
+            HeartbeatMonitor monitor([link] { return vector<shared_ptr<RobotLink>>{ link }; });
+            for (int i = 0; i < 100 && !link->IsAlive(); i++) this_thread::sleep_for(chrono::milliseconds(10));
+            Assert::IsTrue(link->IsAlive());
+            Assert::AreEqual(1UL, link->GetHeartbeats());
+
+            robot.DropReplies(1, ULONG_MAX);
+            chrono::steady_clock::time_point silenced = chrono::steady_clock::now();
+            const int windowMs = HEARTBEAT_INTERVAL_MS * HEARTBEAT_MISSES;
+            while (link->IsAlive() && chrono::steady_clock::now() - silenced < chrono::milliseconds(windowMs + 1000)) {
+                this_thread::sleep_for(chrono::milliseconds(20));
+            }
+            Assert::IsFalse(link->IsAlive());
+            Assert::IsTrue(link->GetSilentMs() >= windowMs);
+            Assert::IsTrue(link->GetHeartbeats() >= 2);
+        }
+
+        // only cores in range and in the process's affinity mask may take a sender
+        TEST_METHOD(IsAllowedCpu_ChecksRangeAndMask)
+        {
+            cpu_set_t allowed;
+            CPU_ZERO(&allowed);
+            Assert::AreEqual(0, sched_getaffinity(0, sizeof(allowed), &allowed));
+            int first = 0;
+            while (!CPU_ISSET(first, &allowed)) first++;
+
+            Assert::IsTrue(RobotLink::IsAllowedCpu(first));
+            Assert::IsFalse(RobotLink::IsAllowedCpu(-1));
+            Assert::IsFalse(RobotLink::IsAllowedCpu(CPU_SETSIZE));
+            Assert::IsFalse(RobotLink::IsAllowedCpu(INT_MAX));
+        }
+
+        // unanswered requests open the breaker, after which work fails at once
+        TEST_METHOD(Breaker_OpensAndFailsFast)
+        {
+            RobotLink link("127.0.0.1", 8097);
+
+            promise<void> timedOut;
+            atomic<int> left(BREAKER_THRESHOLD);
+            for (int i = 0; i < BREAKER_THRESHOLD; i++) {
+                link.SubmitSleep([&](const string&) { if (--left == 0) timedOut.set_value(); });
+            }
+            timedOut.get_future().wait();
+            Assert::IsTrue(link.GetBreakerState() != RobotLink::BREAKER_CLOSED);
+            Assert::AreEqual(1UL, link.GetBreakerTrips());
+
+            string reply;
+            link.SubmitSleep([&reply](const string& r) { reply = r; });
+            Assert::AreEqual(string(UNREACHABLE_REPLY), reply);
+            Assert::AreEqual(1UL, link.GetFailedFast());
+
+            // a drive is refused outright, not reported as queued
+            DriveBody body = { FORWARD, 1, 100 };
+            Assert::AreEqual((int)RobotLink::DRIVE_UNREACHABLE, (int)link.SubmitDrive(body));
+            Assert::AreEqual(2UL, link.GetFailedFast());
+            Assert::AreEqual(0, link.GetInFlight());
+        }
+    };
+
+    TEST_CLASS(RateLimiterTests)
+    {
+    public:
+
+        // a full bucket allows a burst, then one token per interval
+        TEST_METHOD(TokenBucket_BurstThenRate)
+        {
+            TokenBucket bucket;
+            long long now = 1000000000000LL;
+            for (int i = 0; i < 5; i++) {
+                Assert::IsTrue(bucket.TryTake(10, 5, now));
+            }
+            Assert::IsFalse(bucket.TryTake(10, 5, now));
+
+            // 10 per second refills one token every 100ms
+            Assert::IsFalse(bucket.TryTake(10, 5, now + 50000000LL));
+            Assert::IsTrue(bucket.TryTake(10, 5, now + 100000000LL));
+            Assert::IsFalse(bucket.TryTake(10, 5, now + 100000000LL));
+        }
+
+        // each key gets its own bucket
+        TEST_METHOD(BucketTable_SeparateKeys)
+        {
+            BucketTable<64> table;
+            Assert::IsTrue(table.TryTake("10.0.0.1", 1, 1));
+            Assert::IsFalse(table.TryTake("10.0.0.1", 1, 1));
+            Assert::IsTrue(table.TryTake("10.0.0.2", 1, 1));
+            Assert::IsTrue(&table.Find("10.0.0.1") == &table.Find("10.0.0.1"));
+        }
+    };
+
+    TEST_CLASS(RobotDiscoveryTests)
+    {
+    public:
+
+        // network and broadcast addresses are left out, bad ranges refused
+        TEST_METHOD(ParseRange_Hosts)
+        {
+            vector<struct in_addr> hosts;
+            Assert::IsTrue(RobotDiscovery::ParseRange("192.168.1.77/24", hosts));
+            Assert::AreEqual((size_t)254, hosts.size());
+            Assert::AreEqual(string("192.168.1.1"), string(inet_ntoa(hosts.front())));
+            Assert::AreEqual(string("192.168.1.254"), string(inet_ntoa(hosts.back())));
+
+            Assert::IsTrue(RobotDiscovery::ParseRange("10.0.0.255", hosts));
+            Assert::AreEqual((size_t)1, hosts.size());
+
+            Assert::IsFalse(RobotDiscovery::ParseRange("10.0.0.0/8", hosts));
+            Assert::IsFalse(RobotDiscovery::ParseRange("10.0.0.0/33", hosts));
+            Assert::IsFalse(RobotDiscovery::ParseRange("robot/24", hosts));
+        }
+
+        // only the address with a robot behind it answers
+        TEST_METHOD(Scan_FindsStandIn)
+        {
+            RobotStandIn robot;
+            vector<struct in_addr> hosts;
+            RobotDiscovery::ParseRange("127.0.0.0/29", hosts);
+
+            vector<DiscoveredRobot> found = RobotDiscovery::Scan(hosts, robot.GetPort(), 200);
+            Assert::AreEqual((size_t)1, found.size());
+            Assert::AreEqual(string("127.0.0.1"), found[0].Address);
+            Assert::AreEqual(robot.GetPort(), found[0].Port);
+        }
+    };
+
+    TEST_CLASS(TelemetryRollupTests)
+    {
+    public:
+
+        // one reading a second lands in every tier; coarser tiers summarise more
+        TEST_METHOD(Query_PicksCoarsestTier)
+        {
+            TelemetryRollup rollup;
+            for (int i = 0; i < 20; i++) {
+                rollup.Record(Telemetry{ 0, (unsigned short)i, 3, FORWARD, 5, 80 }, 1200 + i);
+            }
+
+            vector<RollupBucket> buckets;
+            Assert::AreEqual(1, rollup.Query(1200, 1219, 5, buckets));
+            Assert::AreEqual((size_t)20, buckets.size());
+
+            Assert::AreEqual(10, rollup.Query(1200, 1219, 30, buckets));
+            Assert::AreEqual((size_t)2, buckets.size());
+            Assert::AreEqual(10u, buckets[1].Count);
+            Assert::AreEqual(10, (int)buckets[1].Fields[0].Min);
+            Assert::AreEqual(19, (int)buckets[1].Fields[0].Max);
+
+            Assert::AreEqual(60, rollup.Query(1200, 1219, 3600, buckets));
+            Assert::AreEqual((size_t)1, buckets.size());
+            Assert::AreEqual(1200LL, buckets[0].StartS);
+            Assert::AreEqual(19, (int)buckets[0].Fields[0].Last);
+            Assert::AreEqual(190ULL, buckets[0].Fields[0].Sum);
+        }
+
+        // a bucket is reused once its tier has wrapped around
+        TEST_METHOD(Record_WrapsRing)
+        {
+            TelemetryRollup rollup;
+            rollup.Record(Telemetry{ 0, 1, 0, 0, 0, 0 }, 1000);
+            rollup.Record(Telemetry{ 0, 2, 0, 0, 0, 0 }, 1000 + TelemetryRollup::Buckets[0]);
+
+            vector<RollupBucket> buckets;
+            rollup.Query(1000, 1000 + TelemetryRollup::Buckets[0], 1, buckets);
+            Assert::AreEqual((size_t)1, buckets.size());
+            Assert::AreEqual(2, (int)buckets[0].Fields[0].Last);
+        }
+
+        // ranges before the epoch or reaching the ends of long long stay inside the rings
+        TEST_METHOD(Query_NegativeAndHugeRanges)
+        {
+            TelemetryRollup rollup;
+            rollup.Record(Telemetry{ 0, 7, 0, 0, 0, 0 }, 30);
+            rollup.Record(Telemetry{ 0, 9, 0, 0, 0, 0 }, -50);
+
+            vector<RollupBucket> buckets;
+            Assert::AreEqual(1, rollup.Query(-100, -50, 1, buckets));
+            Assert::AreEqual((size_t)0, buckets.size());
+
+            rollup.Query(-100, 40, 1, buckets);
+            Assert::AreEqual((size_t)1, buckets.size());
+            Assert::AreEqual(30LL, buckets[0].StartS);
+            Assert::AreEqual(7, (int)buckets[0].Fields[0].Last);
+
+            Assert::AreEqual(60, rollup.Query(LLONG_MIN, LLONG_MAX, INT_MAX, buckets));
+            Assert::AreEqual((size_t)0, buckets.size());
+            rollup.Query(LLONG_MIN, 59, INT_MIN, buckets);
+            Assert::AreEqual((size_t)1, buckets.size());
+            Assert::AreEqual(1u, buckets[0].Count);
+        }
+    };
+
+    TEST_CLASS(TelemetryStreamTests)
+    {
+    public:
+
+        // a delta carries only the changed fields and rebuilds the reading
+        TEST_METHOD(Delta_ChangedFieldsOnly)
+        {
+            Telemetry first = { 1, 300, 2, FORWARD, 5, 80 };
+            Telemetry second = { 2, 300, 2, FORWARD, 5, 80 };
+
+            string key = TelemetryStream::Encode(first, nullptr);
+            string delta = TelemetryStream::Encode(second, &first);
+            Assert::AreEqual((size_t)10, key.size());
+            Assert::AreEqual((size_t)3, delta.size());
+            Assert::AreEqual(1 << SF_PKT_COUNTER, (int)delta[0]);
+
+            Telemetry state = {};
+            Assert::IsTrue(TelemetryStream::Decode(key, state));
+            Assert::IsTrue(TelemetryStream::Decode(delta, state));
+            Assert::AreEqual(2, (int)state.LastPktCounter);
+            Assert::AreEqual(300, (int)state.CurrentGrade);
+            Assert::AreEqual(80, (int)state.LastCmdSpeed);
+            Assert::IsFalse(TelemetryStream::Decode(key.substr(0, 4), state));
+        }
+
+        // subscribers start on a keyframe, unchanged readings send nothing
+        TEST_METHOD(Publish_KeyframeThenDeltas)
+        {
+            TelemetryStream stream;
+            Telemetry reading = { 1, 300, 2, FORWARD, 5, 80 };
+            stream.Publish(reading);
+
+            vector<string> frames;
+            unsigned long id = stream.Subscribe([&frames](const string& frame) { frames.push_back(frame); });
+            stream.Publish(reading);
+            stream.Publish(reading);
+            reading.HitCount = 3;
+            stream.Publish(reading);
+
+            Assert::AreEqual((size_t)2, frames.size());
+            Assert::IsTrue(((unsigned char)frames[0][0] & STREAM_KEYFRAME) != 0);
+            Assert::AreEqual(1 << SF_HIT_COUNT, (int)frames[1][0]);
+
+            stream.Unsubscribe(id);
+            reading.HitCount = 4;
+            stream.Publish(reading);
+            Assert::AreEqual((size_t)2, frames.size());
+        }
+    };
+
+    TEST_CLASS(TracingTests)
+    {
+    public:
+
+        // one request in n gets a trace id, none once sampling is off
+        TEST_METHOD(Sample_OneInN)
+        {
+            Tracer::SetSampleEvery(4);
+            int sampled = 0;
+            for (int i = 0; i < 400; i++) {
+                if (Tracer::Sample() != 0) sampled++;
+            }
+            Assert::AreEqual(100, sampled);
+
+            Tracer::SetSampleEvery(0);
+            for (int i = 0; i < 100; i++) Assert::AreEqual(0UL, Tracer::Sample());
+            Tracer::SetSampleEvery(TRACE_SAMPLE_EVERY);
+        }
+
+        // spans follow the trace id onto another thread and export as Chrome JSON
+        TEST_METHOD(Spans_FollowTraceAcrossThreads)
+        {
+            Tracer::Clear();
+            { TraceScope untraced("untraced"); }
+
+            unsigned long id;
+            {
+                TraceContext trace(777);
+                id = Tracer::Current();
+                TraceScope span("outer");
+            }
+            Assert::AreEqual(0UL, Tracer::Current());
+            {
+                // a span keeps the id it began with, as when a response ends inside it
+                TraceContext trace(778);
+                TraceScope span("cleared");
+                Tracer::SetCurrent(0);
+            }
+
+            thread worker([id] {
+                Tracer::NameThread("worker");
+                TraceContext trace(id);
+                TraceScope span("inner");
+            });
+            worker.join();
+
+            string json = Tracer::Export();
+            Assert::IsTrue(json.find("\"traceEvents\"") != string::npos);
+            Assert::IsTrue(json.find("\"name\":\"outer\"") != string::npos);
+            Assert::IsTrue(json.find("\"name\":\"inner\"") != string::npos);
+            Assert::IsTrue(json.find("\"name\":\"worker\"") != string::npos);
+            Assert::IsTrue(json.find("\"trace\":777") != string::npos);
+            Assert::IsTrue(json.find("\"trace\":778") != string::npos);
+            Assert::IsTrue(json.find("untraced") == string::npos);
+
+            Tracer::Clear();
+            Assert::IsTrue(Tracer::Export().find("outer") == string::npos);
+        }
+    };
+
+    TEST_CLASS(PacketCaptureTests)
+    {
+    public:
+
+        // the ring keeps the newest packets in order, fragments gathered, long ones cut at the snaplen
+        TEST_METHOD(Ring_KeepsNewestInOrder)
+        {
+            unique_ptr<PacketCapture> capture(new PacketCapture());
+            for (int i = 0; i < CAPTURE_PACKETS + 10; i++) {
+                char pkt[5] = { (char)(i & 0xFF), (char)(i >> 8), 0x10, 0, 0 };
+                capture->Record(CAPTURE_SENT, pkt, sizeof(pkt));
+            }
+            char head[4] = { 1, 2, 3, 4 };
+            char tail[1] = { 9 };
+            struct iovec frags[2] = { { head, sizeof(head) }, { tail, sizeof(tail) } };
+            capture->Record(CAPTURE_RECEIVED, frags, 2);
+            string big(CAPTURE_SNAPLEN + 50, 'x');
+            capture->Record(CAPTURE_RECEIVED, big.data(), big.size());
+
+            vector<CapturedPacket> packets = capture->Snapshot();
+            Assert::AreEqual((size_t)CAPTURE_PACKETS, packets.size());
+            Assert::AreEqual(12, (int)(unsigned char)packets[0].Data[0]);
+            Assert::AreEqual(string("\x01\x02\x03\x04\x09", 5), packets[CAPTURE_PACKETS - 2].Data);
+            Assert::IsTrue(packets[CAPTURE_PACKETS - 2].Direction == CAPTURE_RECEIVED);
+            Assert::AreEqual((unsigned int)big.size(), packets.back().Length);
+            Assert::AreEqual((size_t)CAPTURE_SNAPLEN, packets.back().Data.size());
+            Assert::AreEqual((unsigned long long)CAPTURE_PACKETS + 12, capture->GetRecorded());
+        }
+
+        // each packet goes out inside rebuilt IPv4 and UDP headers, addressed by direction
+        TEST_METHOD(ToPcap_WrapsInIpAndUdp)
+        {
+            CaptureEndpoints ends;
+            memset(&ends, 0, sizeof(ends));
+            ends.Family = AF_INET;
+            struct sockaddr_in* local = (struct sockaddr_in*)&ends.Local;
+            struct sockaddr_in* robot = (struct sockaddr_in*)&ends.Robot;
+            inet_pton(AF_INET, "10.0.0.1", &local->sin_addr);
+            local->sin_port = htons(40000);
+            inet_pton(AF_INET, "10.0.0.5", &robot->sin_addr);
+            robot->sin_port = htons(5000);
+
+            vector<CapturedPacket> packets = { { 1500000000123456789LL, CAPTURE_RECEIVED, 5, string("\x01\x00\x0c\x00\x03", 5) } };
+            string pcap = PacketCapture::ToPcap(packets, ends);
+            Assert::AreEqual((size_t)(24 + 16 + 28 + 5), pcap.size());
+
+            const unsigned char* raw = (const unsigned char*)pcap.data();
+            unsigned int magic, linkType, seconds, nanos, kept;
+            memcpy(&magic, raw, 4);
+            memcpy(&linkType, raw + 20, 4);
+            memcpy(&seconds, raw + 24, 4);
+            memcpy(&nanos, raw + 28, 4);
+            memcpy(&kept, raw + 32, 4);
+            Assert::AreEqual(0xa1b23c4du, magic);
+            Assert::AreEqual((unsigned int)PCAP_LINKTYPE_RAW, linkType);
+            Assert::AreEqual(1500000000u, seconds);
+            Assert::AreEqual(123456789u, nanos);
+            Assert::AreEqual(33u, kept);
+
+            // from the robot to us, with a valid header checksum
+            const unsigned char* ip = raw + 40;
+            unsigned long sum = 0;
+            for (int i = 0; i < 20; i += 2) sum += (ip[i] << 8) | ip[i + 1];
+            while (sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
+            Assert::AreEqual(0xFFFFul, sum);
+            Assert::AreEqual(0, memcmp(ip + 12, &robot->sin_addr, 4));
+            Assert::AreEqual(0, memcmp(ip + 16, &local->sin_addr, 4));
+            Assert::AreEqual(5000, (ip[20] << 8) | ip[21]);
+            Assert::AreEqual(40000, (ip[22] << 8) | ip[23]);
+            Assert::AreEqual(13, (ip[24] << 8) | ip[25]);
+            Assert::AreEqual(0, memcmp(ip + 28, packets[0].Data.data(), 5));
+        }
+    };
+
+    // regression limits for the performance tests, deliberately a few times
+    // looser than a typical optimised build so only real slowdowns fail.
+    // override with -D when a build host needs different numbers
+#ifndef PERF_MIN_ENCODE_PPS
+#define PERF_MIN_ENCODE_PPS 1000000
+#endif
+#ifndef PERF_MIN_DECODE_PPS
+#define PERF_MIN_DECODE_PPS 2000000
+#endif
+#ifndef PERF_MAX_RTT_P50_US
+#define PERF_MAX_RTT_P50_US 500
+#endif
+#ifndef PERF_MAX_RTT_P99_US
+#define PERF_MAX_RTT_P99_US 5000
+#endif
+
+    TEST_CLASS(PerformanceTests)
+    {
+    private:
+        static double PacketsPerSecond(int packets, chrono::steady_clock::time_point start) {
+            return packets / chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        }
+
+        static void Report(const string& line) {
+            Logger::WriteMessage((line + "\n").c_str());
+        }
+
+    public:
+
+        // build, checksum and serialise drive packets
+        TEST_METHOD(Encode_PacketsPerSecond)
+        {
+            const int packets = 200000;
+            char body[DRIVEBODYSIZE] = { FORWARD, 5, 80 };
+            volatile char crc = 0;   // keeps the work from being optimised away
+
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            for (int i = 0; i < packets; i++) {
+                PktDef packet;
+                packet.SetCmd(PktDef::DRIVE);
+                packet.SetPktCount(i);
+                packet.SetBodyData(body, DRIVEBODYSIZE);
+                packet.CalcCRC();
+                crc = packet.GenPacket()[HEADERSIZE + DRIVEBODYSIZE];
+            }
+            double pps = PacketsPerSecond(packets, start);
+
+            // the loop's result is read back, so it has to have been worked out
+            PktDef last;
+            last.SetCmd(PktDef::DRIVE);
+            last.SetPktCount(packets - 1);
+            last.SetBodyData(body, DRIVEBODYSIZE);
+            last.CalcCRC();
+            Assert::AreEqual((int)last.GenPacket()[HEADERSIZE + DRIVEBODYSIZE], (int)crc);
+
+            Report("encode: " + to_string((long long)pps) + " packets/s");
+            Assert::IsTrue(pps >= PERF_MIN_ENCODE_PPS);
+        }
+
+        // parse and CRC-check received telemetry packets
+        TEST_METHOD(Decode_PacketsPerSecond)
+        {
+            const int packets = 200000;
+            PktDef source;
+            source.SetCmd(PktDef::RESPONSE);
+            source.SetPktCount(7);
+            char telem[TELEMSIZE];
+            PktDef::EncodeTelemetry(Telemetry{ 7, 300, 2, FORWARD, 5, 80 }, telem);
+            source.SetBodyData(telem, TELEMSIZE);
+            source.CalcCRC();
+            const int size = HEADERSIZE + TELEMSIZE + CRCSIZE;
+            vector<char> raw(source.GenPacket(), source.GenPacket() + size);
+
+            int valid = 0;
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            for (int i = 0; i < packets; i++) {
+                PktDef packet(raw.data(), size);
+                if (packet.CheckCRC(raw.data(), size) && PktDef::DecodeTelemetry(packet.GetBodyData()).LastPktCounter == 7) valid++;
+            }
+            double pps = PacketsPerSecond(packets, start);
+
+            Report("decode: " + to_string((long long)pps) + " packets/s");
+            Assert::AreEqual(packets, valid);
+            Assert::IsTrue(pps >= PERF_MIN_DECODE_PPS);
+        }
+
+        // telemetry round trips through a robot link to a stand-in on loopback
+        TEST_METHOD(Loopback_RoundTrip)
+        {
+            const int samples = 2000;
+            RobotStandIn robot;
+            RobotLink link("127.0.0.1", robot.GetPort());
+
+            // per-packet logging is not what is measured
+            streambuf* console = cout.rdbuf(nullptr);
+            int telemetry = 0;
+            for (int i = 0; i < samples; i++) {
+                promise<string> replied;
+                link.SubmitTelemetry([&replied](const string& reply) { replied.set_value(reply); });
+                if (replied.get_future().get()[0] == '{') telemetry++;
+            }
+            cout.rdbuf(console);
+
+            const LatencyHistogram& rtt = link.GetTotalRtt();
+            Report("loopback rtt: p50 " + to_string(rtt.GetPercentile(0.50)) + " us, p99 " + to_string(rtt.GetPercentile(0.99)) + " us");
+            Assert::AreEqual(samples, telemetry);
+            Assert::IsTrue(rtt.GetPercentile(0.50) <= PERF_MAX_RTT_P50_US);
+            Assert::IsTrue(rtt.GetPercentile(0.99) <= PERF_MAX_RTT_P99_US);
+        }
+    };
 }
\ No newline at end of file
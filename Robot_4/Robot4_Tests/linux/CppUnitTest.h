@@ -0,0 +1,145 @@
+#pragma once
+
+// just enough of the Visual Studio CppUnitTest framework to build and run
+// Robot4_Tests.cpp on Linux. tests register themselves in declaration order;
+// TestMain.cpp runs them
+
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <vector>
+#include <functional>
+#include <typeinfo>
+#include <cxxabi.h>
+#include <cstdlib>
+#include <cstring>
+
+namespace Microsoft { namespace VisualStudio { namespace CppUnitTestFramework {
+
+	// how a value is shown in a failed assertion. specialise for types without operator<<
+	template<typename T>
+	std::wstring ToString(const T& value) {
+		if constexpr (requires(std::wostringstream& out) { out << value; }) {
+			std::wostringstream out;
+			out << value;
+			return out.str();
+		}
+		else if constexpr (requires(std::ostringstream& out) { out << value; }) {
+			std::ostringstream out;
+			out << value;
+			std::string narrow = out.str();
+			return std::wstring(narrow.begin(), narrow.end());
+		}
+		else {
+			return L"?";
+		}
+	}
+
+	inline std::wstring ToString(const std::string& value) {
+		return std::wstring(value.begin(), value.end());
+	}
+
+	// thrown by a failed assertion, caught by the runner
+	struct AssertFailed {
+		std::wstring Message;
+	};
+
+	class Assert
+	{
+	private:
+		static void Check(bool condition, const std::wstring& what, const wchar_t* message) {
+			if (condition) return;
+			throw AssertFailed{ message ? what + L" - " + message : what };
+		}
+
+	public:
+		template<typename T>
+		static void AreEqual(const T& expected, const T& actual, const wchar_t* message = nullptr) {
+			Check(expected == actual, L"AreEqual failed. Expected:<" + ToString(expected) + L"> Actual:<" + ToString(actual) + L">", message);
+		}
+
+		static void AreEqual(const char* expected, const char* actual, const wchar_t* message = nullptr) {
+			Check(strcmp(expected, actual) == 0, L"AreEqual failed. Expected:<" + ToString(std::string(expected)) + L"> Actual:<" + ToString(std::string(actual)) + L">", message);
+		}
+
+		template<typename T>
+		static void AreNotEqual(const T& notExpected, const T& actual, const wchar_t* message = nullptr) {
+			Check(!(notExpected == actual), L"AreNotEqual failed. Value:<" + ToString(actual) + L">", message);
+		}
+
+		static void IsTrue(bool condition, const wchar_t* message = nullptr) {
+			Check(condition, L"IsTrue failed", message);
+		}
+
+		static void IsFalse(bool condition, const wchar_t* message = nullptr) {
+			Check(!condition, L"IsFalse failed", message);
+		}
+
+		template<typename T>
+		static void IsNull(const T* pointer, const wchar_t* message = nullptr) {
+			Check(pointer == nullptr, L"IsNull failed", message);
+		}
+
+		template<typename T>
+		static void IsNotNull(const T* pointer, const wchar_t* message = nullptr) {
+			Check(pointer != nullptr, L"IsNotNull failed", message);
+		}
+
+		static void Fail(const wchar_t* message = nullptr) {
+			Check(false, L"Fail", message);
+		}
+	};
+
+	class Logger
+	{
+	public:
+		static void WriteMessage(const char* message) {
+			std::cerr << message;
+		}
+
+		static void WriteMessage(const wchar_t* message) {
+			std::wcerr << message;
+		}
+	};
+
+	// every test, in the order it was declared
+	struct TestInfo {
+		std::string Class;
+		std::string Method;
+		std::function<void()> Run;
+	};
+
+	inline std::vector<TestInfo>& Registry() {
+		static std::vector<TestInfo> tests;
+		return tests;
+	}
+
+	template<typename T>
+	bool Register(const char* method, std::function<void()> run) {
+		int status = 0;
+		char* name = abi::__cxa_demangle(typeid(T).name(), nullptr, nullptr, &status);
+		std::string className = (status == 0 && name) ? name : typeid(T).name();
+		free(name);
+		size_t scope = className.rfind("::");
+		if (scope != std::string::npos) className = className.substr(scope + 2);
+
+		Registry().push_back(TestInfo{ className, method, run });
+		return true;
+	}
+
+	template<typename T>
+	class TestClass
+	{
+	public:
+		typedef T ThisClass;
+	};
+
+}}}
+
+#define TEST_CLASS(className) class className : public ::Microsoft::VisualStudio::CppUnitTestFramework::TestClass<className>
+
+// each test gets a fresh instance of its class, as under Visual Studio
+#define TEST_METHOD(methodName) \
+	static void Run_##methodName() { ThisClass instance; instance.methodName(); } \
+	inline static const bool Registered_##methodName = ::Microsoft::VisualStudio::CppUnitTestFramework::Register<ThisClass>(#methodName, &Run_##methodName); \
+	void methodName()
@@ -0,0 +1,55 @@
+// runs the tests registered by CppUnitTest.h.
+//   usage: robot4_tests [Class | Class::Method]...
+// with no arguments every test runs. exits non-zero if any test failed
+#include "CppUnitTest.h"
+
+#include <iostream>
+#include <chrono>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+using namespace std;
+
+static bool Selected(const TestInfo& test, int argc, char** argv) {
+	if (argc < 2) return true;
+	for (int i = 1; i < argc; i++) {
+		if (test.Class == argv[i] || test.Class + "::" + test.Method == argv[i]) return true;
+	}
+	return false;
+}
+
+int main(int argc, char** argv) {
+	int run = 0;
+	int failed = 0;
+	for (const TestInfo& test : Registry()) {
+		if (!Selected(test, argc, argv)) continue;
+		run++;
+
+		string name = test.Class + "::" + test.Method;
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		string error;
+		try {
+			test.Run();
+		}
+		catch (const AssertFailed& failure) {
+			error = string(failure.Message.begin(), failure.Message.end());
+		}
+		catch (const exception& ex) {
+			error = string("unexpected exception: ") + ex.what();
+		}
+		catch (...) {
+			error = "unexpected exception";
+		}
+		long long ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+
+		if (error.empty()) {
+			cerr << "PASS " << name << " (" << ms << " ms)" << endl;
+		}
+		else {
+			cerr << "FAIL " << name << " (" << ms << " ms): " << error << endl;
+			failed++;
+		}
+	}
+
+	cerr << run - failed << "/" << run << " passed" << endl;
+	return (run == 0 || failed > 0) ? 1 : 0;
+}
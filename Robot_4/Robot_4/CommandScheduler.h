@@ -0,0 +1,316 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include "RobotLink.h"
+#include "TeleCommand.h"
+#include "MpscQueue.h"
+#include "LatencyStats.h"
+
+using namespace std;
+
+// the timer fires this early and the last stretch is spun, so dispatch
+// does not depend on how promptly the kernel wakes the thread (us)
+#define SCHEDULER_SPIN_US 200
+
+// finished plans kept around for progress queries
+#define SCHEDULER_HISTORY 256
+
+// one step of a command plan: send Cmd at AtMs after the plan starts
+struct PlanStep {
+	unsigned int AtMs;
+	TeleCommand Cmd;
+};
+
+// runs time-stamped command plans against robot links from a single thread.
+// the next step of every active plan sits in one deadline heap; a timerfd is
+// armed for the earliest, and the thread sleeps in poll() between steps.
+// dispatching a step is just a push onto the robot's lanes, so one thread
+// keeps hundreds of robots on schedule
+class CommandScheduler
+{
+public:
+	enum PlanState {
+		PLAN_PENDING,     // waiting for its first step
+		PLAN_RUNNING,
+		PLAN_DONE,        // every step dispatched
+		PLAN_CANCELLED
+	};
+
+	// a snapshot of one plan
+	struct PlanProgress {
+		unsigned long Id;
+		PlanState State;
+		size_t Steps;
+		size_t Dispatched;          // steps handed to the robot link
+		size_t Unreachable;         // steps dropped because the robot's breaker was open
+		unsigned long SleepsAcked;  // sleep steps the robot answered
+		double MeanLateUs;          // dispatch time past each step's deadline
+		double MaxLateUs;
+	};
+
+private:
+	typedef chrono::steady_clock Clock;
+
+	struct Plan {
+		unsigned long Id;
+		shared_ptr<RobotLink> Link;          // scheduler thread only, dropped when the plan ends
+		vector<PlanStep> Steps;
+		Clock::time_point Start;
+		atomic<size_t> Taken;                // steps dealt with; the next one is Steps[Taken]
+		atomic<size_t> Dispatched;
+		atomic<size_t> Unreachable;
+		atomic<unsigned long> SleepsAcked;
+		atomic<bool> bCancelled;
+		LatencyHistogram Lateness;
+	};
+
+	// the next step of one plan
+	struct Due {
+		Clock::time_point At;
+		shared_ptr<Plan> Owner;
+		bool operator>(const Due& other) const { return At > other.At; }
+	};
+
+	int TimerFd;                         // armed for the earliest deadline
+	int EventFd;                         // new plans, cancels and shutdown
+	MpscQueue<shared_ptr<Plan>> Incoming;
+	atomic<bool> bCancelPending;         // a plan was cancelled, its steps are still in the heap
+	atomic<bool> bRunning;
+
+	mutex PlansLock;                     // plan lookup for progress and cancel
+	map<unsigned long, shared_ptr<Plan>> Plans;
+	unsigned long NextId;
+
+	LatencyHistogram Lateness;           // every dispatch, across all plans
+	thread Worker;
+
+	static struct itimerspec DeadlineSpec(Clock::time_point at) {
+		// steady_clock is CLOCK_MONOTONIC, which the timer runs on
+		chrono::nanoseconds ns = chrono::duration_cast<chrono::nanoseconds>(at.time_since_epoch());
+		struct itimerspec spec;
+		memset(&spec, 0, sizeof(spec));
+		spec.it_value.tv_sec = ns.count() / 1000000000;
+		spec.it_value.tv_nsec = ns.count() % 1000000000;
+		if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) spec.it_value.tv_nsec = 1;  // zero disarms
+		return spec;
+	}
+
+	// hand one step to its robot. a sleep reply counts toward the plan's acks
+	void Dispatch(const shared_ptr<Plan>& plan, Clock::time_point deadline) {
+		const PlanStep& step = plan->Steps[plan->Taken];
+		bool delivered = true;
+		if (step.Cmd.Cmd == PktDef::SLEEP) {
+			shared_ptr<Plan> owner = plan;
+			plan->Link->SubmitSleep([owner](const string& reply) {
+				if (reply.rfind("Robot replied", 0) == 0) owner->SleepsAcked++;
+			});
+		}
+		else {
+			delivered = plan->Link->SubmitDrive(step.Cmd.Body) != RobotLink::DRIVE_UNREACHABLE;
+		}
+
+		double lateUs = chrono::duration<double, micro>(Clock::now() - deadline).count();
+		plan->Lateness.Record(lateUs);
+		Lateness.Record(lateUs);
+		if (delivered) plan->Dispatched++;
+		else plan->Unreachable++;
+		plan->Taken++;
+	}
+
+	// forget the oldest finished plans beyond SCHEDULER_HISTORY
+	void Prune() {
+		lock_guard<mutex> lock(PlansLock);
+		size_t finished = 0;
+		for (auto& item : Plans) {
+			if (item.second->Taken == item.second->Steps.size() || item.second->bCancelled) finished++;
+		}
+		for (auto it = Plans.begin(); it != Plans.end() && finished > SCHEDULER_HISTORY;) {
+			Plan& plan = *it->second;
+			if (plan.Taken == plan.Steps.size() || plan.bCancelled) {
+				it = Plans.erase(it);
+				finished--;
+			}
+			else {
+				++it;
+			}
+		}
+	}
+
+	// take the steps of cancelled plans out of the heap, letting go of their links
+	static bool DropCancelled(vector<Due>& heap) {
+		auto cancelled = partition(heap.begin(), heap.end(), [](const Due& due) { return !due.Owner->bCancelled; });
+		if (cancelled == heap.end()) return false;
+		for (auto it = cancelled; it != heap.end(); ++it) it->Owner->Link.reset();
+		heap.erase(cancelled, heap.end());
+		make_heap(heap.begin(), heap.end(), greater<Due>());
+		return true;
+	}
+
+	// wait out the last stretch before a deadline: spin, pausing the core, for at
+	// most SCHEDULER_SPIN_US, then yield in case the thread was held up getting here
+	static void SpinUntil(Clock::time_point at) {
+		Clock::time_point spinEnd = Clock::now() + chrono::microseconds(SCHEDULER_SPIN_US);
+		Clock::time_point now;
+		while ((now = Clock::now()) < at) {
+			if (now < spinEnd) RobotLink::CpuRelax();
+			else this_thread::yield();
+		}
+	}
+
+	void WorkerLoop() {
+		// ask for the tightest timer slack the kernel allows on this thread
+		prctl(PR_SET_TIMERSLACK, 1UL);
+
+		vector<Due> heap;                // earliest first, via push_heap/pop_heap
+		while (bRunning) {
+			shared_ptr<Plan> added;
+			while (Incoming.Pop(added)) {
+				heap.push_back(Due{ added->Start + chrono::milliseconds(added->Steps[0].AtMs), added });
+				push_heap(heap.begin(), heap.end(), greater<Due>());
+			}
+			bool finishedAny = bCancelPending.exchange(false) && DropCancelled(heap);
+
+			// dispatch everything due, spinning through the last SCHEDULER_SPIN_US
+			while (!heap.empty() && heap.front().At - chrono::microseconds(SCHEDULER_SPIN_US) <= Clock::now()) {
+				pop_heap(heap.begin(), heap.end(), greater<Due>());
+				Due next = move(heap.back());
+				heap.pop_back();
+				if (next.Owner->bCancelled) {
+					next.Owner->Link.reset();
+					finishedAny = true;
+					continue;
+				}
+
+				SpinUntil(next.At);
+				Dispatch(next.Owner, next.At);
+
+				Plan& plan = *next.Owner;
+				if (plan.Taken < plan.Steps.size()) {
+					heap.push_back(Due{ plan.Start + chrono::milliseconds(plan.Steps[plan.Taken].AtMs), next.Owner });
+					push_heap(heap.begin(), heap.end(), greater<Due>());
+				}
+				else {
+					// kept for progress queries, but no longer holding the link open
+					plan.Link.reset();
+					finishedAny = true;
+				}
+			}
+			if (finishedAny) Prune();
+
+			struct itimerspec spec;
+			memset(&spec, 0, sizeof(spec));
+			if (!heap.empty()) spec = DeadlineSpec(heap.front().At - chrono::microseconds(SCHEDULER_SPIN_US));
+			timerfd_settime(TimerFd, TFD_TIMER_ABSTIME, &spec, nullptr);
+
+			struct pollfd fds[2] = { { TimerFd, POLLIN, 0 }, { EventFd, POLLIN, 0 } };
+			if (poll(fds, 2, -1) < 0) continue;
+
+			uint64_t count;
+			if (fds[0].revents & POLLIN) read(TimerFd, &count, sizeof(count));
+			if (fds[1].revents & POLLIN) read(EventFd, &count, sizeof(count));
+		}
+	}
+
+public:
+	CommandScheduler() {
+		bRunning = true;
+		bCancelPending = false;
+		NextId = 1;
+		TimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		EventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (TimerFd < 0 || EventFd < 0) {
+			cerr << "ERROR: Failed to create scheduler timers: " << strerror(errno) << endl;
+		}
+		Worker = thread(&CommandScheduler::WorkerLoop, this);
+	}
+
+	~CommandScheduler() {
+		bRunning = false;
+		uint64_t one = 1;
+		write(EventFd, &one, sizeof(one));
+		Worker.join();
+		close(TimerFd);
+		close(EventFd);
+	}
+
+	CommandScheduler(const CommandScheduler&) = delete;
+	CommandScheduler& operator=(const CommandScheduler&) = delete;
+
+	// run steps (at least one) against link, with AtMs counted from startInMs
+	// from now. returns the plan's id
+	unsigned long Schedule(shared_ptr<RobotLink> link, const vector<PlanStep>& steps, unsigned int startInMs) {
+		shared_ptr<Plan> plan = make_shared<Plan>();
+		plan->Link = link;
+		plan->Steps = steps;
+		stable_sort(plan->Steps.begin(), plan->Steps.end(), [](const PlanStep& a, const PlanStep& b) { return a.AtMs < b.AtMs; });
+		plan->Start = Clock::now() + chrono::milliseconds(startInMs);
+		plan->Taken = 0;
+		plan->Dispatched = 0;
+		plan->Unreachable = 0;
+		plan->SleepsAcked = 0;
+		plan->bCancelled = false;
+		{
+			lock_guard<mutex> lock(PlansLock);
+			plan->Id = NextId++;
+			Plans[plan->Id] = plan;
+		}
+
+		Incoming.Push(plan);
+		uint64_t one = 1;
+		write(EventFd, &one, sizeof(one));
+		return plan->Id;
+	}
+
+	// stop a plan before its remaining steps go out; false if it is unknown or finished.
+	// the scheduler drops the plan's steps and its link straight away
+	bool Cancel(unsigned long id) {
+		{
+			lock_guard<mutex> lock(PlansLock);
+			auto found = Plans.find(id);
+			if (found == Plans.end()) return false;
+			Plan& plan = *found->second;
+			if (plan.Taken == plan.Steps.size()) return false;
+			if (plan.bCancelled.exchange(true)) return false;
+		}
+
+		bCancelPending = true;
+		uint64_t one = 1;
+		write(EventFd, &one, sizeof(one));
+		return true;
+	}
+
+	bool GetProgress(unsigned long id, PlanProgress& out) {
+		lock_guard<mutex> lock(PlansLock);
+		auto found = Plans.find(id);
+		if (found == Plans.end()) return false;
+
+		Plan& plan = *found->second;
+		out.Id = id;
+		out.Steps = plan.Steps.size();
+		out.Dispatched = plan.Dispatched;
+		out.Unreachable = plan.Unreachable;
+		size_t taken = plan.Taken;
+		out.SleepsAcked = plan.SleepsAcked;
+		out.MeanLateUs = plan.Lateness.GetMean();
+		out.MaxLateUs = plan.Lateness.GetMax();
+		if (plan.bCancelled) out.State = PLAN_CANCELLED;
+		else if (taken == out.Steps) out.State = PLAN_DONE;
+		else if (taken > 0) out.State = PLAN_RUNNING;
+		else out.State = PLAN_PENDING;
+		return true;
+	}
+
+	// how late steps go out, across every plan (us)
+	const LatencyHistogram& GetLateness() const { return Lateness; }
+};
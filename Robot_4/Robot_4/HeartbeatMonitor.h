@@ -0,0 +1,60 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include "RobotLink.h"
+
+using namespace std;
+
+// keeps every registered robot's liveness and reply timeout current, and its
+// telemetry stream fed. every TELEMETRY_STREAM_MS it asks each link to ping
+// its robot; a link only does so if the robot has been quiet (or its stream
+// is due a reading), so busy robots cost nothing extra
+class HeartbeatMonitor
+{
+public:
+	// the links to watch, looked up afresh on every round
+	typedef function<vector<shared_ptr<RobotLink>>()> LinkSource;
+
+private:
+	LinkSource Links;
+	mutex Lock;
+	condition_variable Wake;
+	bool bRunning;
+	thread Worker;
+
+	void WorkerLoop() {
+		unique_lock<mutex> lock(Lock);
+		while (bRunning) {
+			Wake.wait_for(lock, chrono::milliseconds(TELEMETRY_STREAM_MS));
+			if (!bRunning) break;
+
+			lock.unlock();
+			for (shared_ptr<RobotLink>& link : Links()) link->Heartbeat();
+			lock.lock();
+		}
+	}
+
+public:
+	HeartbeatMonitor(LinkSource links) : Links(links) {
+		bRunning = true;
+		Worker = thread(&HeartbeatMonitor::WorkerLoop, this);
+	}
+
+	~HeartbeatMonitor() {
+		{
+			lock_guard<mutex> lock(Lock);
+			bRunning = false;
+		}
+		Wake.notify_one();
+		Worker.join();
+	}
+
+	HeartbeatMonitor(const HeartbeatMonitor&) = delete;
+	HeartbeatMonitor& operator=(const HeartbeatMonitor&) = delete;
+};
@@ -0,0 +1,222 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+
+using namespace std;
+
+// how long a resolved name is trusted (s). getaddrinfo does not expose
+// record TTLs, so every name gets the same one
+#define RESOLVE_TTL_S 60
+
+// how soon a failed lookup is tried again (s)
+#define RESOLVE_RETRY_S 5
+
+// robot hostnames resolved off the request path. lookups run on one
+// background thread and land in a TTL cache; names a link is watching are
+// refreshed before they expire, and a stale answer is served while the
+// refresh runs, so only the very first lookup of a name is ever waited on.
+// numeric IPv4/IPv6 addresses pass straight through.
+class HostResolver
+{
+public:
+	// addresses (numeric, IPv4 and/or IPv6) or a non-empty error
+	typedef function<void(const vector<string>& addrs, const string& error)> ResolveHandler;
+
+private:
+	typedef chrono::steady_clock Clock;
+
+	struct Entry {
+		vector<string> Addrs;          // last good answer, empty until the first
+		string Error;                  // why the last lookup failed
+		Clock::time_point Expires;     // refresh due (or retry, after a failure)
+		int Watchers = 0;              // links that want this name kept fresh
+		bool bQueued = false;          // a lookup is queued or running
+		vector<ResolveHandler> Waiting; // callers with nothing cached to serve
+	};
+
+	mutex Lock;
+	condition_variable Work;
+	map<string, Entry> Cache;
+	deque<string> Queue;               // names to look up, in order
+	atomic<unsigned int> Generation;   // bumped whenever a cached answer changes
+	bool bRunning;
+	thread Worker;
+
+	static bool IsNumeric(const string& host) {
+		unsigned char addr[sizeof(struct in6_addr)];
+		return inet_pton(AF_INET, host.c_str(), addr) == 1 || inet_pton(AF_INET6, host.c_str(), addr) == 1;
+	}
+
+	// blocking lookup, resolver thread only
+	static vector<string> Lookup(const string& host, string& error) {
+		struct addrinfo hints;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_DGRAM;
+
+		struct addrinfo* results = nullptr;
+		int err = getaddrinfo(host.c_str(), nullptr, &hints, &results);
+		if (err != 0) {
+			error = gai_strerror(err);
+			return vector<string>();
+		}
+
+		vector<string> addrs;
+		for (struct addrinfo* ai = results; ai; ai = ai->ai_next) {
+			char text[NI_MAXHOST];
+			if (getnameinfo(ai->ai_addr, ai->ai_addrlen, text, sizeof(text), nullptr, 0, NI_NUMERICHOST) != 0) continue;
+			if (find(addrs.begin(), addrs.end(), text) == addrs.end()) addrs.push_back(text);
+		}
+		freeaddrinfo(results);
+
+		if (addrs.empty()) error = "no addresses";
+		return addrs;
+	}
+
+	// caller holds Lock
+	void QueueLookup(const string& host, Entry& entry) {
+		if (entry.bQueued) return;
+		entry.bQueued = true;
+		Queue.push_back(host);
+		Work.notify_one();
+	}
+
+	// watched names are looked up again a little before they expire
+	void QueueDueRefreshes() {
+		Clock::time_point soon = Clock::now() + chrono::seconds(RESOLVE_TTL_S / 10);
+		for (auto& item : Cache) {
+			if (item.second.Watchers > 0 && item.second.Expires <= soon) QueueLookup(item.first, item.second);
+		}
+	}
+
+	void WorkerLoop() {
+		unique_lock<mutex> lock(Lock);
+		while (bRunning) {
+			QueueDueRefreshes();
+			if (Queue.empty()) {
+				Work.wait_for(lock, chrono::seconds(1));
+				continue;
+			}
+
+			string host = Queue.front();
+			Queue.pop_front();
+
+			lock.unlock();
+			string error;
+			vector<string> addrs = Lookup(host, error);
+			lock.lock();
+
+			Entry& entry = Cache[host];
+			entry.bQueued = false;
+			entry.Error = error;
+			if (!addrs.empty()) {
+				if (addrs != entry.Addrs) Generation++;
+				entry.Addrs = addrs;
+				entry.Expires = Clock::now() + chrono::seconds(RESOLVE_TTL_S);
+			}
+			else {
+				// keep serving the last good answer, if any, and try again soon
+				entry.Expires = Clock::now() + chrono::seconds(RESOLVE_RETRY_S);
+			}
+
+			vector<ResolveHandler> waiting;
+			waiting.swap(entry.Waiting);
+			vector<string> answer = entry.Addrs;
+			if (entry.Watchers == 0 && entry.Addrs.empty()) Cache.erase(host);
+
+			lock.unlock();
+			for (ResolveHandler& handler : waiting) handler(answer, answer.empty() ? error : "");
+			lock.lock();
+		}
+	}
+
+public:
+	HostResolver() {
+		Generation = 0;
+		bRunning = true;
+		Worker = thread(&HostResolver::WorkerLoop, this);
+	}
+
+	~HostResolver() {
+		{
+			lock_guard<mutex> lock(Lock);
+			bRunning = false;
+		}
+		Work.notify_one();
+		Worker.join();
+	}
+
+	HostResolver(const HostResolver&) = delete;
+	HostResolver& operator=(const HostResolver&) = delete;
+
+	// never blocks: answers at once from the cache (fresh or stale) and
+	// refreshes in the background, or calls back on the resolver thread once
+	// a first lookup finishes
+	void Resolve(const string& host, ResolveHandler onDone) {
+		if (IsNumeric(host)) {
+			onDone(vector<string>{ host }, "");
+			return;
+		}
+
+		unique_lock<mutex> lock(Lock);
+		Entry& entry = Cache[host];
+		if (entry.Addrs.empty()) {
+			entry.Waiting.push_back(onDone);
+			QueueLookup(host, entry);
+			return;
+		}
+
+		if (entry.Expires <= Clock::now()) QueueLookup(host, entry);
+		vector<string> addrs = entry.Addrs;
+		lock.unlock();
+		onDone(addrs, "");
+	}
+
+	// whatever is cached for host right now, without looking anything up
+	bool GetCached(const string& host, vector<string>& addrs) {
+		if (IsNumeric(host)) {
+			addrs = vector<string>{ host };
+			return true;
+		}
+
+		lock_guard<mutex> lock(Lock);
+		auto found = Cache.find(host);
+		if (found == Cache.end() || found->second.Addrs.empty()) return false;
+		addrs = found->second.Addrs;
+		return true;
+	}
+
+	// keep host refreshed in the background while anyone is watching it
+	void Watch(const string& host) {
+		if (IsNumeric(host)) return;
+		lock_guard<mutex> lock(Lock);
+		Entry& entry = Cache[host];
+		entry.Watchers++;
+		if (entry.Addrs.empty()) QueueLookup(host, entry);
+	}
+
+	void Unwatch(const string& host) {
+		if (IsNumeric(host)) return;
+		lock_guard<mutex> lock(Lock);
+		auto found = Cache.find(host);
+		if (found != Cache.end() && found->second.Watchers > 0) found->second.Watchers--;
+	}
+
+	// changes whenever some cached name resolves to different addresses
+	unsigned int GetGeneration() const { return Generation; }
+};
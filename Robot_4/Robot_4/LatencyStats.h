@@ -0,0 +1,147 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+
+using namespace std;
+
+// lock-free latency histogram in microseconds. buckets are log-linear: each
+// power of two is split into LATENCY_SUBBUCKETS, so any recorded value is
+// reported within ~25% and percentiles stay cheap to read while writers record.
+#define LATENCY_SUBBUCKETS 4
+#define LATENCY_BUCKETS (1 + 32 * LATENCY_SUBBUCKETS)
+
+class LatencyHistogram
+{
+private:
+	atomic<unsigned long> Buckets[LATENCY_BUCKETS];
+	atomic<unsigned long> Count;
+	atomic<unsigned long long> SumUs;
+	atomic<unsigned long long> MaxUs;
+
+	// bucket 0 holds everything under 1us
+	static int BucketOf(double us) {
+		if (us < 1.0) return 0;
+		int exp = ilogb(us);
+		int sub = (int)((us / ldexp(1.0, exp) - 1.0) * LATENCY_SUBBUCKETS);
+		int bucket = 1 + exp * LATENCY_SUBBUCKETS + sub;
+		return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+	}
+
+	// largest value that lands in a bucket
+	static double UpperBound(int bucket) {
+		if (bucket == 0) return 1.0;
+		int exp = (bucket - 1) / LATENCY_SUBBUCKETS;
+		int sub = (bucket - 1) % LATENCY_SUBBUCKETS;
+		return ldexp(1.0 + (double)(sub + 1) / LATENCY_SUBBUCKETS, exp);
+	}
+
+public:
+	LatencyHistogram() {
+		Reset();
+	}
+
+	void Record(double us) {
+		if (us < 0) us = 0;
+		Buckets[BucketOf(us)].fetch_add(1, memory_order_relaxed);
+		Count.fetch_add(1, memory_order_relaxed);
+		SumUs.fetch_add((unsigned long long)us, memory_order_relaxed);
+
+		unsigned long long value = (unsigned long long)us;
+		unsigned long long seen = MaxUs.load(memory_order_relaxed);
+		while (value > seen && !MaxUs.compare_exchange_weak(seen, value, memory_order_relaxed)) {}
+	}
+
+	void Reset() {
+		for (int i = 0; i < LATENCY_BUCKETS; i++) Buckets[i] = 0;
+		Count = 0;
+		SumUs = 0;
+		MaxUs = 0;
+	}
+
+	unsigned long GetCount() const { return Count.load(memory_order_relaxed); }
+	double GetMax() const { return (double)MaxUs.load(memory_order_relaxed); }
+
+	double GetMean() const {
+		unsigned long count = GetCount();
+		return count ? (double)SumUs.load(memory_order_relaxed) / count : 0.0;
+	}
+
+	// p in [0, 1]; 0 when nothing has been recorded
+	double GetPercentile(double p) const {
+		unsigned long count = GetCount();
+		if (count == 0) return 0.0;
+
+		unsigned long target = (unsigned long)ceil(p * count);
+		if (target == 0) target = 1;
+
+		unsigned long seen = 0;
+		for (int i = 0; i < LATENCY_BUCKETS; i++) {
+			seen += Buckets[i].load(memory_order_relaxed);
+			if (seen >= target) {
+				double bound = UpperBound(i);
+				return bound < GetMax() ? bound : GetMax();
+			}
+		}
+		return GetMax();
+	}
+};
+
+// bounds on an adaptive reply timeout (ms). the floor keeps scheduling noise
+// on a fast robot from reading as loss; the ceiling caps backoff on a dead one
+#define RTO_MIN_MS 10
+#define RTO_MAX_MS 2000
+
+// smoothed round trip, its variation and the timeout they imply, Jacobson/
+// Karels style (RFC 6298): srtt += (r - srtt)/8, rttvar += (|srtt - r| -
+// rttvar)/4, timeout = srtt + 4*rttvar. a timeout doubles the timeout until
+// the next answer (Karn), and never becomes a sample. one writer; readers
+// see each value atomically
+class RttEstimator
+{
+private:
+	atomic<double> SrttUs;      // 0 until the first sample
+	atomic<double> RttVarUs;
+	atomic<double> RtoUs;
+
+	static double Clamp(double us) {
+		if (us < RTO_MIN_MS * 1000.0) return RTO_MIN_MS * 1000.0;
+		if (us > RTO_MAX_MS * 1000.0) return RTO_MAX_MS * 1000.0;
+		return us;
+	}
+
+public:
+	// initialRtoMs is used until the first sample
+	RttEstimator(int initialRtoMs) {
+		SrttUs = 0.0;
+		RttVarUs = 0.0;
+		RtoUs = Clamp(initialRtoMs * 1000.0);
+	}
+
+	void Sample(double us) {
+		double srtt = SrttUs.load(memory_order_relaxed);
+		double rttVar = RttVarUs.load(memory_order_relaxed);
+		if (srtt == 0.0) {
+			srtt = us;
+			rttVar = us / 2;
+		}
+		else {
+			rttVar += (fabs(srtt - us) - rttVar) / 4;
+			srtt += (us - srtt) / 8;
+		}
+		SrttUs.store(srtt, memory_order_relaxed);
+		RttVarUs.store(rttVar, memory_order_relaxed);
+		RtoUs.store(Clamp(srtt + 4 * rttVar), memory_order_relaxed);
+	}
+
+	void Timeout() {
+		RtoUs.store(Clamp(RtoUs.load(memory_order_relaxed) * 2), memory_order_relaxed);
+	}
+
+	double GetSrtt() const { return SrttUs.load(memory_order_relaxed); }
+	double GetRttVar() const { return RttVarUs.load(memory_order_relaxed); }
+	double GetRto() const { return RtoUs.load(memory_order_relaxed); }
+
+	// the timeout rounded up to whole milliseconds
+	int GetRtoMs() const { return (int)ceil(GetRto() / 1000.0); }
+};
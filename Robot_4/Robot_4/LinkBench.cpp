@@ -0,0 +1,50 @@
+// round trip jitter of a robot link in the default blocking mode versus
+// low-latency mode, against a stand-in robot on loopback.
+//   usage: link_bench [samples] [cpu] [busy_poll_us]
+// cpu defaults to the last core; isolate it (isolcpus=) for meaningful numbers
+#include "RobotLink.h"
+#include "RobotStandIn.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <future>
+
+using namespace std;
+
+// time samples telemetry requests one after another, submit to reply
+void RunMode(const char* name, int port, RobotLink::LinkOptions options, int samples) {
+	RobotLink link("127.0.0.1", port, options);
+	LatencyHistogram latency;
+
+	for (int i = 0; i < samples + samples / 10; i++) {
+		promise<void> replied;
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		link.SubmitTelemetry([&replied](const string&) { replied.set_value(); });
+		replied.get_future().wait();
+		double us = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+
+		// the first tenth warms caches and the stand-in
+		if (i >= samples / 10) latency.Record(us);
+	}
+
+	double p50 = latency.GetPercentile(0.50);
+	double p99 = latency.GetPercentile(0.99);
+	printf("%-12s %8lu %9.1f %9.1f %9.1f %9.1f %9.1f %11.1f\n", name, latency.GetCount(), latency.GetMean(),
+		p50, latency.GetPercentile(0.90), p99, latency.GetMax(), p99 - p50);
+}
+
+int main(int argc, char** argv) {
+	int samples = argc > 1 ? atoi(argv[1]) : 5000;
+	int cpu = argc > 2 ? atoi(argv[2]) : (int)thread::hardware_concurrency() - 1;
+	int busyPollUs = argc > 3 ? atoi(argv[3]) : 0;
+
+	// per-packet logging would dominate what is being measured
+	cout.rdbuf(nullptr);
+
+	RobotStandIn robot;
+	printf("%-12s %8s %9s %9s %9s %9s %9s %11s\n", "mode", "samples", "mean_us", "p50_us", "p90_us", "p99_us", "max_us", "jitter_us");
+	RunMode("blocking", robot.GetPort(), RobotLink::LinkOptions{ false, -1, 0 }, samples);
+	RobotLink::LockMemory();
+	RunMode("low-latency", robot.GetPort(), RobotLink::LinkOptions{ true, cpu, busyPollUs }, samples);
+	return 0;
+}
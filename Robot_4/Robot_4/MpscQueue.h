@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+using namespace std;
+
+// unbounded lock-free multi-producer / single-consumer queue (Vyukov style).
+// any thread may Push; only one thread may Pop. T must be default
+// constructible and movable.
+template<typename T>
+class MpscQueue
+{
+private:
+	struct Node {
+		atomic<Node*> Next;
+		T Value;
+		Node() : Next(nullptr) {}
+	};
+
+	atomic<Node*> Head;   // most recently pushed node, producers swap this
+	Node* Tail;           // stub node in front of the oldest value, consumer only
+
+public:
+	MpscQueue() {
+		Node* stub = new Node();
+		Head = stub;
+		Tail = stub;
+	}
+
+	~MpscQueue() {
+		T discard;
+		while (Pop(discard)) {}
+		delete Tail;
+	}
+
+	MpscQueue(const MpscQueue&) = delete;
+	MpscQueue& operator=(const MpscQueue&) = delete;
+
+	// wait-free: one exchange and one store
+	void Push(T value) {
+		Node* node = new Node();
+		node->Value = move(value);
+		Node* prev = Head.exchange(node, memory_order_acq_rel);
+		prev->Next.store(node, memory_order_release);
+	}
+
+	// consumer only. may briefly miss a value whose producer is between the
+	// exchange and the link; that producer signals afterwards, so retry then
+	bool Pop(T& out) {
+		Node* next = Tail->Next.load(memory_order_acquire);
+		if (!next) return false;
+
+		out = move(next->Value);
+		delete Tail;
+		Tail = next;
+		return true;
+	}
+
+	// consumer only. like Pop, may miss a value whose push is still being linked
+	bool IsEmpty() const {
+		return Tail->Next.load(memory_order_acquire) == nullptr;
+	}
+};
@@ -10,6 +10,14 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <span>
+#include <vector>
+#include <mutex>
+#ifdef __linux__
+#include <linux/net_tstamp.h>
+#endif
 
 using namespace std;
 
@@ -31,16 +39,104 @@ enum ConnectionType
 class MySocket 
 {
 private:
-	char* Buffer;                // raw data buffer
+	char* Buffer;                // raw data buffer, first member of the receive pool
+	vector<char*> FreeBuffers;   // MaxSize buffers ready to lend out
+	mutex PoolLock;              // buffers may come back from another thread
 	int WelcomeSocket;           // for accepting TCP client connections
 	int ConnectionSocket;        // connection socket (TCP/UDP)
-	struct sockaddr_in SvrAddr;  // server address struct
+	struct sockaddr_storage SvrAddr; // server address struct, IPv4 or IPv6
+	socklen_t SvrAddrLen;        // bytes of SvrAddr in use
 	SocketType mySocket;         // CLIENT or SERVER
 	string IPAddr;               // IP address string
 	int port;                    // Port number
 	ConnectionType connectionType; // TCP or UDP
 	bool bTCPConnect;            // TCP connection status
 	int MaxSize;                 // buffer size
+	bool bTimestamps;            // kernel timestamps requested for datagrams
+	bool bRxStamped;             // LastRxStamp belongs to the last datagram received
+	struct timespec LastRxStamp; // kernel arrival time of the last datagram
+	bool bVerbose;               // log every send to cout
+
+	// pull a kernel timestamp out of a received message's control data
+	static bool ReadStamp(struct msghdr* msg, struct timespec& out) {
+		for (struct cmsghdr* c = CMSG_FIRSTHDR(msg); c; c = CMSG_NXTHDR(msg, c)) {
+			if (c->cmsg_level != SOL_SOCKET) continue;
+#ifdef SCM_TIMESTAMPING
+			if (c->cmsg_type == SCM_TIMESTAMPING) {
+				// software stamp is the first of three
+				struct timespec stamps[3];
+				memcpy(stamps, CMSG_DATA(c), sizeof(stamps));
+				out = stamps[0];
+				return true;
+			}
+#endif
+#ifdef SCM_TIMESTAMPNS
+			if (c->cmsg_type == SCM_TIMESTAMPNS) {
+				memcpy(&out, CMSG_DATA(c), sizeof(out));
+				return true;
+			}
+#endif
+		}
+		return false;
+	}
+
+	// recvfrom, but keeping the kernel's arrival timestamp
+	int RecvStamped(char* dest, int capacity, int flags) {
+		struct iovec iov = { dest, (size_t)capacity };
+		char control[256];
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		int received = recvmsg(ConnectionSocket, &msg, MSG_TRUNC | flags);
+		if (received >= 0) {
+			bRxStamped = ReadStamp(&msg, LastRxStamp);
+		}
+		return received;
+	}
+
+	// fill addr from a numeric IPv4 or IPv6 address (no name lookups here)
+	static bool ParseAddress(const string& ip, int portNumber, struct sockaddr_storage& addr, socklen_t& addrLen) {
+		memset(&addr, 0, sizeof(addr));
+		struct sockaddr_in* v4 = (struct sockaddr_in*)&addr;
+		struct sockaddr_in6* v6 = (struct sockaddr_in6*)&addr;
+		if (inet_pton(AF_INET, ip.c_str(), &v4->sin_addr) == 1) {
+			v4->sin_family = AF_INET;
+			v4->sin_port = htons(portNumber);
+			addrLen = sizeof(*v4);
+			return true;
+		}
+		if (inet_pton(AF_INET6, ip.c_str(), &v6->sin6_addr) == 1) {
+			v6->sin6_family = AF_INET6;
+			v6->sin6_port = htons(portNumber);
+			addrLen = sizeof(*v6);
+			return true;
+		}
+
+		// leave an unroutable IPv4 address behind, as before
+		v4->sin_family = AF_INET;
+		v4->sin_port = htons(portNumber);
+		addrLen = sizeof(*v4);
+		return false;
+	}
+
+	// one receive call, flags passed through. -1 with errno set on failure
+	int Receive(char* dest, int capacity, int flags) {
+		struct sockaddr_storage FromAddr;
+		socklen_t addrLen = sizeof(FromAddr);
+
+		if (connectionType == TCP) {
+			return recv(mySocket == SERVER ? WelcomeSocket : ConnectionSocket, dest, capacity, flags);
+		}
+		if (bTimestamps) {
+			return RecvStamped(dest, capacity, flags);
+		}
+		// MSG_TRUNC reports the real datagram size so truncation is not silent
+		return recvfrom(ConnectionSocket, dest, capacity, MSG_TRUNC | flags, (struct sockaddr*)&FromAddr, &addrLen);
+	}
 
 public:
 	// constructor to initialize socket properties and allocate buffer
@@ -51,6 +147,10 @@ public:
 		port = portNumber;
 		this->connectionType = connectionType;
 		bTCPConnect = false;
+		WelcomeSocket = -1;
+		bTimestamps = false;
+		bRxStamped = false;
+		bVerbose = true;
 
 		// use default buffer if the new one is invalid
 		if (bufferSize > 0) {
@@ -60,15 +160,15 @@ public:
 		}
 
 		Buffer = new char[MaxSize]; // allocate for the new buffer
+		FreeBuffers.push_back(Buffer);
 
 		// Initialize socket address structure
-		memset(&SvrAddr, 0, sizeof(SvrAddr));
-		SvrAddr.sin_family = AF_INET;
-		SvrAddr.sin_port = htons(port);
-		inet_pton(AF_INET, IPAddr.c_str(), &SvrAddr.sin_addr);
+		if (!ParseAddress(IPAddr, port, SvrAddr, SvrAddrLen)) {
+			cerr << "ERROR: Invalid IP address: " << IPAddr << endl;
+		}
 
-		// Create socket
-		ConnectionSocket = socket(AF_INET, (connectionType == TCP ? SOCK_STREAM : SOCK_DGRAM), 0);
+		// Create socket in the address's family
+		ConnectionSocket = socket(SvrAddr.ss_family, (connectionType == TCP ? SOCK_STREAM : SOCK_DGRAM), 0);
 		if (ConnectionSocket < 0) {
 			cerr << "ERROR: Failed to create socket: " << strerror(errno) << endl;
 			exit(1);
@@ -83,7 +183,7 @@ public:
 				exit(1);
 			}
 
-			if (bind(ConnectionSocket, (struct sockaddr*)&SvrAddr, sizeof(SvrAddr)) < 0) {
+			if (bind(ConnectionSocket, (struct sockaddr*)&SvrAddr, SvrAddrLen) < 0) {
 				cerr << "ERROR: Failed to bind socket: " << strerror(errno) << endl;
 				close(ConnectionSocket);
 				exit(1);
@@ -97,7 +197,7 @@ public:
 				}
 
 				cout << "Waiting for client connection..." << endl;
-				struct sockaddr_in clientAddr;
+				struct sockaddr_storage clientAddr;
 				socklen_t clientLen = sizeof(clientAddr);
 				WelcomeSocket = accept(ConnectionSocket, (struct sockaddr*)&clientAddr, &clientLen);
 				if (WelcomeSocket < 0) {
@@ -114,7 +214,10 @@ public:
 
 	// destructor to clean up sockets and buffer
 	~MySocket() {
-		delete[] Buffer;
+		// lent buffers must be returned before the socket goes away
+		for (char* buf : FreeBuffers) {
+			delete[] buf;
+		}
 		if (bTCPConnect) {
 			close(WelcomeSocket);
 		}
@@ -129,7 +232,7 @@ public:
 			return;
 		}
 
-		if (connect(ConnectionSocket, (struct sockaddr*)&SvrAddr, sizeof(SvrAddr)) < 0) {
+		if (connect(ConnectionSocket, (struct sockaddr*)&SvrAddr, SvrAddrLen) < 0) {
 			cerr << "ERROR: TCP connection failed: " << strerror(errno) << endl;
 			return;
 		}
@@ -166,52 +269,246 @@ public:
 				sent = send(ConnectionSocket, data, size, 0);
 			}
 		} else {
-			sent = sendto(ConnectionSocket, data, size, 0, (struct sockaddr*)&SvrAddr, sizeof(SvrAddr));
+			sent = sendto(ConnectionSocket, data, size, 0, (struct sockaddr*)&SvrAddr, SvrAddrLen);
 		}
 
 		if (sent < 0) {
 			cerr << "ERROR: Failed to send data: " << strerror(errno) << endl;
-		} else {
+		} else if (bVerbose) {
 			cout << "Sent " << sent << " bytes" << endl;
 		}
 	}
 
-	// Receive data and copy it into the destination buffer
-	int GetData(char* dest) {
-		struct sockaddr_in FromAddr;
-		socklen_t addrLen = sizeof(FromAddr);
-		int received = 0;
+	// send one message gathered from several fragments with a single sendmsg,
+	// so the caller never has to assemble them into one buffer
+	void SendData(const struct iovec* frags, int count) {
+		size_t size = 0;
+		for (int i = 0; i < count; i++) {
+			size += frags[i].iov_len;
+		}
+		if (size > (size_t)MaxSize) {
+			cerr << "ERROR: Data exceeds buffer size" << endl;
+			return;
+		}
 
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = (struct iovec*)frags;
+		msg.msg_iovlen = count;
+
+		int sock = ConnectionSocket;
 		if (connectionType == TCP) {
-			if (mySocket == SERVER) {
-				received = recv(WelcomeSocket, Buffer, MaxSize, 0);
-			} else {
-				received = recv(ConnectionSocket, Buffer, MaxSize, 0);
-			}
+			if (mySocket == SERVER) sock = WelcomeSocket;
 		} else {
-			received = recvfrom(ConnectionSocket, Buffer, MaxSize, 0, (struct sockaddr*)&FromAddr, &addrLen);
+			msg.msg_name = &SvrAddr;
+			msg.msg_namelen = SvrAddrLen;
 		}
 
+		int sent = sendmsg(sock, &msg, 0);
+		if (sent < 0) {
+			cerr << "ERROR: Failed to send data: " << strerror(errno) << endl;
+		} else if (bVerbose) {
+			cout << "Sent " << sent << " bytes" << endl;
+		}
+	}
+
+	// Receive data straight into the destination buffer (no intermediate copy).
+	// returns the bytes received, or -1 on error, timeout, or a datagram
+	// bigger than capacity
+	int GetData(char* dest, int capacity) {
+		if (!dest || capacity <= 0) {
+			cerr << "ERROR: No room to receive into" << endl;
+			return -1;
+		}
+
+		int received = Receive(dest, capacity, 0);
 		if (received < 0) {
 			cerr << "ERROR: Failed to receive data: " << strerror(errno) << endl;
 			return -1;
 		}
+		if (received > capacity) {
+			cerr << "ERROR: Received " << received << " bytes, destination holds " << capacity << endl;
+			return -1;
+		}
 
-		memcpy(dest, Buffer, received);
 		return received;
 	}
 
+	// poll for data without blocking: the bytes received, 0 if nothing is
+	// waiting yet, or -1 on error or a datagram bigger than capacity
+	int TryGetData(char* dest, int capacity) {
+		if (!dest || capacity <= 0) {
+			cerr << "ERROR: No room to receive into" << endl;
+			return -1;
+		}
+
+		int received = Receive(dest, capacity, MSG_DONTWAIT);
+		if (received < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			cerr << "ERROR: Failed to receive data: " << strerror(errno) << endl;
+			return -1;
+		}
+		if (received > capacity) {
+			cerr << "ERROR: Received " << received << " bytes, destination holds " << capacity << endl;
+			return -1;
+		}
+
+		return received;
+	}
+
+	// bounds-checked receive into a caller-provided span
+	int GetData(span<char> dest) {
+		return GetData(dest.data(), (int)dest.size());
+	}
+
+	// Receive data into the destination buffer, which must hold MaxSize bytes
+	int GetData(char* dest) {
+		return GetData(dest, MaxSize);
+	}
+
+	// receive into a MaxSize buffer lent from the socket's pool and set size to
+	// the bytes received. hand the buffer back with ReturnData() when done;
+	// returns nullptr on failure
+	char* LendData(int& size) {
+		char* buf = nullptr;
+		{
+			lock_guard<mutex> lock(PoolLock);
+			if (!FreeBuffers.empty()) {
+				buf = FreeBuffers.back();
+				FreeBuffers.pop_back();
+			}
+		}
+		if (!buf) {
+			buf = new char[MaxSize];
+		}
+
+		size = GetData(buf, MaxSize);
+		if (size < 0) {
+			ReturnData(buf);
+			return nullptr;
+		}
+		return buf;
+	}
+
+	// give back a buffer from LendData()
+	void ReturnData(char* buf) {
+		if (!buf) return;
+		lock_guard<mutex> lock(PoolLock);
+		FreeBuffers.push_back(buf);
+	}
+
+	// set a receive timeout in milliseconds (0 blocks forever)
+	void SetTimeout(int ms) {
+		struct timeval tv;
+		tv.tv_sec = ms / 1000;
+		tv.tv_usec = (ms % 1000) * 1000;
+
+		int sock = (connectionType == TCP && mySocket == SERVER) ? WelcomeSocket : ConnectionSocket;
+		if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+			cerr << "ERROR: Failed to set receive timeout: " << strerror(errno) << endl;
+		}
+	}
+
+	// ask the kernel to busy-poll the device queue for up to us microseconds
+	// when a receive finds nothing waiting. raising it past net.core.busy_read
+	// needs CAP_NET_ADMIN; returns false if the kernel refuses
+	bool SetBusyPoll(int us) {
+#ifdef SO_BUSY_POLL
+		if (setsockopt(ConnectionSocket, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us)) == 0) {
+			return true;
+		}
+		cerr << "ERROR: Failed to enable busy polling: " << strerror(errno) << endl;
+#else
+		cerr << "ERROR: Busy polling is not supported on this platform" << endl;
+#endif
+		return false;
+	}
+
+	// turn the per-send log line on or off
+	void SetVerbose(bool verbose) { bVerbose = verbose; }
+
+	// UDP only: have the kernel timestamp datagrams as they leave and arrive
+	// (software stamps, CLOCK_REALTIME). falls back to receive-only stamps
+	// where send stamps are unsupported; returns false if neither works
+	bool EnableTimestamps() {
+		if (connectionType != UDP) {
+			cerr << "ERROR: Kernel timestamps are only supported for UDP" << endl;
+			return false;
+		}
+
+#ifdef SO_TIMESTAMPING
+		int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE |
+			SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_TSONLY;
+		if (setsockopt(ConnectionSocket, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == 0) {
+			bTimestamps = true;
+			return true;
+		}
+#endif
+#ifdef SO_TIMESTAMPNS
+		int on = 1;
+		if (setsockopt(ConnectionSocket, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == 0) {
+			bTimestamps = true;
+			return true;
+		}
+#endif
+		cerr << "ERROR: Failed to enable kernel timestamps: " << strerror(errno) << endl;
+		return false;
+	}
+
+	// kernel arrival time of the last datagram received by GetData()
+	bool GetRxTimestamp(struct timespec& out) {
+		if (!bTimestamps || !bRxStamped) return false;
+		out = LastRxStamp;
+		return true;
+	}
+
+	// kernel departure time of the most recently sent datagram. send stamps
+	// queue up on the socket's error queue; this drains it and keeps the newest
+	bool GetTxTimestamp(struct timespec& out) {
+		if (!bTimestamps) return false;
+
+		bool found = false;
+		while (true) {
+			char data[64];
+			char control[256];
+			struct iovec iov = { data, sizeof(data) };
+			struct msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = &iov;
+			msg.msg_iovlen = 1;
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+
+			if (recvmsg(ConnectionSocket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) break;
+			if (ReadStamp(&msg, out)) found = true;
+		}
+		return found;
+	}
+
 	// get current IP address
 	string GetIPAddr() { return IPAddr; }
 
-	// change IP address if not connected
+	// change IP address if not connected. the socket was opened for one address
+	// family, so an IPv4 socket cannot be pointed at an IPv6 address or back
 	void SetIPAddr(string newIP) {
 		if (bTCPConnect) {
 			cerr << "ERROR: Cannot change IP while connected" << endl;
 			return;
 		}
+
+		struct sockaddr_storage addr;
+		socklen_t addrLen;
+		if (!ParseAddress(newIP, port, addr, addrLen)) {
+			cerr << "ERROR: Invalid IP address: " << newIP << endl;
+			return;
+		}
+		if (addr.ss_family != SvrAddr.ss_family) {
+			cerr << "ERROR: Cannot change address family of an open socket" << endl;
+			return;
+		}
 		IPAddr = newIP;
-		inet_pton(AF_INET, IPAddr.c_str(), &SvrAddr.sin_addr);
+		SvrAddr = addr;
+		SvrAddrLen = addrLen;
 	}
 
 	// change port if not connected
@@ -221,10 +518,22 @@ public:
 			return;
 		}
 		port = newPort;
-		SvrAddr.sin_port = htons(port);
+		if (SvrAddr.ss_family == AF_INET6) {
+			((struct sockaddr_in6*)&SvrAddr)->sin6_port = htons(port);
+		} else {
+			((struct sockaddr_in*)&SvrAddr)->sin_port = htons(port);
+		}
 	}
 
 	int GetPort() { return port; }
+	int GetFamily() { return SvrAddr.ss_family; }
+
+	// the address and port data goes out from; a UDP client has port 0 until it first sends
+	bool GetLocalAddress(struct sockaddr_storage& addr) {
+		memset(&addr, 0, sizeof(addr));
+		socklen_t addrLen = sizeof(addr);
+		return getsockname(ConnectionSocket, (struct sockaddr*)&addr, &addrLen) == 0;
+	}
 	SocketType GetType() { return mySocket; }
 
 	void SetType(SocketType newType) {
@@ -0,0 +1,222 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+using namespace std;
+
+// packets each robot link keeps; older ones are overwritten
+#define CAPTURE_PACKETS 256
+
+// bytes kept of each packet. robot packets are at most 260 bytes, so only
+// an oversized reply is ever cut short
+#define CAPTURE_SNAPLEN 264
+
+// pcap link type for bare IPv4/IPv6 packets, no link layer
+#define PCAP_LINKTYPE_RAW 101
+
+enum CaptureDirection {
+	CAPTURE_SENT,
+	CAPTURE_RECEIVED
+};
+
+// one packet as it went over the wire
+struct CapturedPacket {
+	long long TimeNs;            // wall clock, since the epoch
+	CaptureDirection Direction;
+	unsigned int Length;         // on the wire; Data may hold fewer bytes
+	string Data;
+};
+
+// the two ends of a robot link, for the addresses in a pcap export
+struct CaptureEndpoints {
+	int Family;                  // AF_INET or AF_INET6
+	struct sockaddr_storage Local;
+	struct sockaddr_storage Robot;
+};
+
+// the last CAPTURE_PACKETS packets one robot link sent and received, kept
+// all the time for protocol debugging. only the link's sender thread
+// records, so recording takes no lock and does not wait: it stamps the
+// slot's sequence odd, copies, and stamps it even. Snapshot() may run on
+// any thread at any time; it copies each slot and keeps it only if the
+// sequence was even and unchanged around the copy
+class PacketCapture
+{
+private:
+	struct Slot {
+		atomic<unsigned long long> Seq;   // 2n+1 while packet n is written, 2n+2 once it is
+		long long TimeNs;
+		unsigned char Direction;
+		unsigned int Length;
+		unsigned int Kept;
+		char Data[CAPTURE_SNAPLEN];
+	};
+
+	Slot Slots[CAPTURE_PACKETS];
+	atomic<unsigned long long> Next;      // packets ever recorded
+
+	static long long NowNs() {
+		return chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+	}
+
+	Slot& Begin(unsigned long long& n) {
+		n = Next.load(memory_order_relaxed);
+		Slot& slot = Slots[n % CAPTURE_PACKETS];
+		slot.Seq.store(2 * n + 1, memory_order_relaxed);
+		atomic_thread_fence(memory_order_release);
+		return slot;
+	}
+
+	void End(Slot& slot, unsigned long long n) {
+		slot.Seq.store(2 * n + 2, memory_order_release);
+		Next.store(n + 1, memory_order_release);
+	}
+
+	template <typename T>
+	static void Put(string& out, T value) {
+		out.append((const char*)&value, sizeof(value));
+	}
+
+	// ones' complement sum, for the IPv4 header checksum
+	static unsigned short Checksum(const unsigned char* data, size_t size) {
+		unsigned long sum = 0;
+		for (size_t i = 0; i + 1 < size; i += 2) sum += (data[i] << 8) | data[i + 1];
+		while (sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
+		return htons((unsigned short)~sum);
+	}
+
+	// the IP and UDP headers the packet had on the wire, rebuilt from the link's ends
+	static string IpHeaders(const CaptureEndpoints& ends, const CapturedPacket& pkt) {
+		const struct sockaddr_storage& from = pkt.Direction == CAPTURE_SENT ? ends.Local : ends.Robot;
+		const struct sockaddr_storage& to = pkt.Direction == CAPTURE_SENT ? ends.Robot : ends.Local;
+		unsigned short udpLength = (unsigned short)(8 + pkt.Length);
+
+		string headers;
+		if (ends.Family == AF_INET6) {
+			Put<unsigned int>(headers, htonl(0x60000000));
+			Put<unsigned short>(headers, htons(udpLength));
+			headers += (char)IPPROTO_UDP;
+			headers += (char)64;
+			headers.append((const char*)&((const struct sockaddr_in6*)&from)->sin6_addr, 16);
+			headers.append((const char*)&((const struct sockaddr_in6*)&to)->sin6_addr, 16);
+		}
+		else {
+			headers += (char)0x45;
+			headers += (char)0;
+			Put<unsigned short>(headers, htons((unsigned short)(20 + udpLength)));
+			Put<unsigned int>(headers, 0);      // id, flags, fragment offset
+			headers += (char)64;
+			headers += (char)IPPROTO_UDP;
+			Put<unsigned short>(headers, 0);
+			headers.append((const char*)&((const struct sockaddr_in*)&from)->sin_addr, 4);
+			headers.append((const char*)&((const struct sockaddr_in*)&to)->sin_addr, 4);
+			unsigned short sum = Checksum((const unsigned char*)headers.data(), headers.size());
+			memcpy(&headers[10], &sum, sizeof(sum));
+		}
+
+		// ports sit at the same offset in both families; the UDP checksum is left out
+		Put<unsigned short>(headers, ((const struct sockaddr_in*)&from)->sin_port);
+		Put<unsigned short>(headers, ((const struct sockaddr_in*)&to)->sin_port);
+		Put<unsigned short>(headers, htons(udpLength));
+		Put<unsigned short>(headers, 0);
+		return headers;
+	}
+
+public:
+	PacketCapture() {
+		for (Slot& slot : Slots) slot.Seq = 0;
+		Next = 0;
+	}
+
+	PacketCapture(const PacketCapture&) = delete;
+	PacketCapture& operator=(const PacketCapture&) = delete;
+
+	// record one packet. sender thread only
+	void Record(CaptureDirection direction, const char* data, size_t size) {
+		unsigned long long n;
+		Slot& slot = Begin(n);
+		slot.TimeNs = NowNs();
+		slot.Direction = (unsigned char)direction;
+		slot.Length = (unsigned int)size;
+		slot.Kept = (unsigned int)(size < CAPTURE_SNAPLEN ? size : CAPTURE_SNAPLEN);
+		memcpy(slot.Data, data, slot.Kept);
+		End(slot, n);
+	}
+
+	// record one packet sent from fragments. sender thread only
+	void Record(CaptureDirection direction, const struct iovec* frags, int count) {
+		unsigned long long n;
+		Slot& slot = Begin(n);
+		slot.TimeNs = NowNs();
+		slot.Direction = (unsigned char)direction;
+		slot.Length = 0;
+		slot.Kept = 0;
+		for (int i = 0; i < count; i++) {
+			size_t room = CAPTURE_SNAPLEN - slot.Kept;
+			size_t take = frags[i].iov_len < room ? frags[i].iov_len : room;
+			memcpy(slot.Data + slot.Kept, frags[i].iov_base, take);
+			slot.Kept += (unsigned int)take;
+			slot.Length += (unsigned int)frags[i].iov_len;
+		}
+		End(slot, n);
+	}
+
+	// the packets still in the ring, oldest first. a packet being
+	// overwritten while it is copied is left out
+	vector<CapturedPacket> Snapshot() const {
+		vector<CapturedPacket> out;
+		unsigned long long end = Next.load(memory_order_acquire);
+		unsigned long long first = end > CAPTURE_PACKETS ? end - CAPTURE_PACKETS : 0;
+		for (unsigned long long n = first; n < end; n++) {
+			const Slot& slot = Slots[n % CAPTURE_PACKETS];
+			unsigned long long seq = slot.Seq.load(memory_order_acquire);
+			if (seq != 2 * n + 2) continue;
+
+			CapturedPacket pkt;
+			pkt.TimeNs = slot.TimeNs;
+			pkt.Direction = (CaptureDirection)slot.Direction;
+			pkt.Length = slot.Length;
+			unsigned int kept = slot.Kept < CAPTURE_SNAPLEN ? slot.Kept : CAPTURE_SNAPLEN;
+			pkt.Data.assign(slot.Data, kept);
+
+			atomic_thread_fence(memory_order_acquire);
+			if (slot.Seq.load(memory_order_relaxed) != seq) continue;
+			out.push_back(move(pkt));
+		}
+		return out;
+	}
+
+	unsigned long long GetRecorded() const { return Next; }
+
+	// packets as a pcap file Wireshark opens directly: each robot packet in
+	// the UDP datagram and IP packet it travelled in
+	static string ToPcap(const vector<CapturedPacket>& packets, const CaptureEndpoints& ends) {
+		string out;
+		Put<unsigned int>(out, 0xa1b23c4d);          // nanosecond timestamps
+		Put<unsigned short>(out, 2);
+		Put<unsigned short>(out, 4);
+		Put<int>(out, 0);
+		Put<unsigned int>(out, 0);
+		Put<unsigned int>(out, 65535);
+		Put<unsigned int>(out, PCAP_LINKTYPE_RAW);
+
+		for (const CapturedPacket& pkt : packets) {
+			string headers = IpHeaders(ends, pkt);
+			Put<unsigned int>(out, (unsigned int)(pkt.TimeNs / 1000000000));
+			Put<unsigned int>(out, (unsigned int)(pkt.TimeNs % 1000000000));
+			Put<unsigned int>(out, (unsigned int)(headers.size() + pkt.Data.size()));
+			Put<unsigned int>(out, (unsigned int)(headers.size() + pkt.Length));
+			out += headers;
+			out += pkt.Data;
+		}
+		return out;
+	}
+};
@@ -3,6 +3,8 @@
 #include <iostream>
 #include <fstream>
 #include <bitset>
+#include <cstring>
+#include "WireSchema.h"
 
 #define HEADERSIZE 4 // header size = 2 bytes (PktCount) + 1 byte (command flags with padding) + 1 bytes (length)
 #define FORWARD 1
@@ -27,26 +29,58 @@ typedef struct DriveBody {
 	unsigned char Speed;
 }DRIVEBODY;
 
-// Add size constants
-#define TELEMSIZE sizeof(TELEMETRY)
+// wire layouts (little endian, explicit offsets)
+typedef WireSchema<Telemetry,
+	WireField<0, &Telemetry::LastPktCounter>,
+	WireField<2, &Telemetry::CurrentGrade>,
+	WireField<4, &Telemetry::HitCount>,
+	WireField<6, &Telemetry::LastCmd>,
+	WireField<7, &Telemetry::LastCmdValue>,
+	WireField<8, &Telemetry::LastCmdSpeed>> TelemetryCodec;
+
+typedef WireSchema<DriveBody,
+	WireField<0, &DriveBody::Direction>,
+	WireField<1, &DriveBody::Duration>,
+	WireField<2, &DriveBody::Speed>> DriveBodyCodec;
+
+// Add size constants (wire sizes). a telemetry body is sizeof(TELEMETRY) on
+// the wire, as robots send it: the 9 bytes of fields and a trailing pad byte
+#define TELEMSIZE 10
 #define CRCSIZE sizeof(unsigned char)
-#define DRIVEBODYSIZE sizeof(DRIVEBODY)
+#define DRIVEBODYSIZE 3
+
+static_assert(TelemetryCodec::Size + 1 == TELEMSIZE, "telemetry wire size");
+static_assert(DriveBodyCodec::Size == DRIVEBODYSIZE, "drive body wire size");
+static_assert(sizeof(DRIVEBODY) == DRIVEBODYSIZE, "DriveBody is sent as raw bytes");
 
 class PktDef
 {
 private:
-	// struct for the packet header
+	// struct for the packet header (in memory; HeaderCodec fixes the wire layout)
 	struct Header
 	{
 		unsigned short int PktCount;
-		unsigned char Drive : 1;
-		unsigned char Status : 1;
-		unsigned char Sleep : 1;
-		unsigned char Ack : 1;
-		unsigned char Padding : 4;
+		unsigned char Drive;
+		unsigned char Status;
+		unsigned char Sleep;
+		unsigned char Ack;
+		unsigned char Padding;
 		unsigned char Length;
 	}Head;
 
+	// header on the wire: PktCount, then flags in one byte (bit 0 Drive,
+	// bit 1 Status, bit 2 Sleep, bit 3 Ack, bits 4-7 padding), then Length
+	typedef WireSchema<Header,
+		WireField<0, &Header::PktCount>,
+		WireBits<2, 0, 1, &Header::Drive>,
+		WireBits<2, 1, 1, &Header::Status>,
+		WireBits<2, 2, 1, &Header::Sleep>,
+		WireBits<2, 3, 1, &Header::Ack>,
+		WireBits<2, 4, 4, &Header::Padding>,
+		WireField<3, &Header::Length>> HeaderCodec;
+
+	static_assert(HeaderCodec::Size == HEADERSIZE, "header wire size");
+
 	// struct for a whole command packet
 	struct CmdPacket {
 		Header Head;          // packet header
@@ -56,12 +90,19 @@ private:
 
 	CmdPacket Packet;        // instance of command packet for this object
 	char* RawBuffer;         // raw byte buffer for sending and receiving serialized packet data
+	unsigned char WireHead[HEADERSIZE]; // encoded header handed out by GetFragments
 
 
 public:
 
 	// integer definitions
 
+	// one contiguous piece of a serialized packet
+	struct Fragment {
+		const char* Data;
+		int Size;
+	};
+
 	// enum to represent the three command types
 	enum CmdType {
 		DRIVE,
@@ -93,8 +134,10 @@ public:
 	// overloaded constructor
 	PktDef(char* src)
 	{
-		// copy header
-		memcpy(&Packet.Head, src, HEADERSIZE);
+		RawBuffer = nullptr;
+
+		// decode header
+		HeaderCodec::Decode((unsigned char*)src, Packet.Head);
 
 		// copy data if its there
 		if (Packet.Head.Length > 0)
@@ -111,12 +154,76 @@ public:
 		memcpy(&Packet.CRC, src + HEADERSIZE + Packet.Head.Length, sizeof(Packet.CRC));
 	}
 
+	// bounds-checked constructor for a received buffer of size bytes. a buffer
+	// too short for its header, declared body and CRC gives an empty packet
+	PktDef(const char* src, int size) : PktDef()
+	{
+		if (!src || size < HEADERSIZE + (int)CRCSIZE) return;
+
+		Header head;
+		HeaderCodec::Decode((const unsigned char*)src, head);
+		if (size < HEADERSIZE + head.Length + (int)CRCSIZE) return;
+
+		Packet.Head = head;
+		if (head.Length > 0)
+		{
+			Packet.Data = new char[head.Length];
+			memcpy(Packet.Data, src + HEADERSIZE, head.Length);
+		}
+		Packet.CRC = (unsigned char)src[HEADERSIZE + head.Length];
+	}
+
 	~PktDef()
 	{
 		if (Packet.Data) delete[] Packet.Data;
 		if (RawBuffer) delete[] RawBuffer;
 	}
 
+	// packets own their buffers: moves hand them over, copies must go through Clone()
+	PktDef(const PktDef&) = delete;
+	PktDef& operator=(const PktDef&) = delete;
+
+	PktDef(PktDef&& other) noexcept
+	{
+		Packet = other.Packet;
+		RawBuffer = other.RawBuffer;
+
+		other.Packet.Data = nullptr;
+		other.Packet.Head.Length = 0;
+		other.RawBuffer = nullptr;
+	}
+
+	PktDef& operator=(PktDef&& other) noexcept
+	{
+		if (this != &other)
+		{
+			if (Packet.Data) delete[] Packet.Data;
+			if (RawBuffer) delete[] RawBuffer;
+
+			Packet = other.Packet;
+			RawBuffer = other.RawBuffer;
+
+			other.Packet.Data = nullptr;
+			other.Packet.Head.Length = 0;
+			other.RawBuffer = nullptr;
+		}
+		return *this;
+	}
+
+	// deep copy of the header, body and CRC (the raw buffer is rebuilt by GenPacket)
+	PktDef Clone() const
+	{
+		PktDef copy;
+		copy.Packet.Head = Packet.Head;
+		copy.Packet.CRC = Packet.CRC;
+		if (Packet.Data && Packet.Head.Length > 0)
+		{
+			copy.Packet.Data = new char[Packet.Head.Length];
+			memcpy(copy.Packet.Data, Packet.Data, Packet.Head.Length);
+		}
+		return copy;
+	}
+
 	// setters 
 	void SetCmd(CmdType cmd)
 	{
@@ -209,39 +316,34 @@ public:
 
 
 
+	// telemetry body helpers
+	static Telemetry DecodeTelemetry(const char* body)
+	{
+		Telemetry telem;
+		TelemetryCodec::Decode((const unsigned char*)body, telem);
+		return telem;
+	}
+
+	static void EncodeTelemetry(const Telemetry& telem, char* body)
+	{
+		TelemetryCodec::Encode(telem, (unsigned char*)body);
+		body[TELEMSIZE - 1] = 0;
+	}
+
 	// packet functions
 	void CalcCRC()
 	{
 		int count = 0;
-		
-		// Count header bits
-		for (int i = 0; i < 16; i++) 
-			count += (1 & (Packet.Head.PktCount >> i));
-		
-		count += (1 & (Packet.Head.Drive));
-		count += (1 & (Packet.Head.Status));
-		count += (1 & (Packet.Head.Sleep));
-		count += (1 & (Packet.Head.Ack));
-		
-		for (int i = 0; i < 4; i++) 
-			count += (1 & (Packet.Head.Padding >> i));
-		
-		for (int i = 0; i < 8; i++) 
-			count += (1 & (Packet.Head.Length >> i));
-
-		// Count body bits based on packet type
-		if (Packet.Head.Ack == 1 && Packet.Data) {
-			// Count telemetry bits
-			for (int i = 0; i < TELEMSIZE; i++) {
-				count += std::bitset<8>(Packet.Data[i]).count();
-			}
-		}
-		else if (Packet.Head.Drive == 1 && Packet.Data) {
-			// Count drive body bits
-			for (int i = 0; i < DRIVEBODYSIZE; i++) {
-				count += std::bitset<8>(Packet.Data[i]).count();
-			}
-		}
+
+		// Count header bits as they go on the wire
+		unsigned char head[HEADERSIZE];
+		HeaderCodec::Encode(Packet.Head, head);
+		for (int i = 0; i < HEADERSIZE; i++)
+			count += std::bitset<8>(head[i]).count();
+
+		// Count body bits, whatever the packet type
+		for (int i = 0; i < Packet.Head.Length; i++)
+			count += std::bitset<8>(Packet.Data[i]).count();
 
 		Packet.CRC = static_cast<unsigned char>(count);
 	}
@@ -261,6 +363,21 @@ public:
 		// Compare calculated CRC with the stored CRC
 		return crc == static_cast<unsigned char>(buf[size - 1]);
 	}
+	// header, body and CRC as separate fragments for a scatter-gather send,
+	// so nothing is copied into RawBuffer. valid until the packet changes
+	int GetFragments(Fragment frags[3])
+	{
+		HeaderCodec::Encode(Packet.Head, WireHead);
+
+		int count = 0;
+		frags[count++] = Fragment{ (const char*)WireHead, HEADERSIZE };
+		if (Packet.Head.Length > 0 && Packet.Data) {
+			frags[count++] = Fragment{ Packet.Data, Packet.Head.Length };
+		}
+		frags[count++] = Fragment{ (const char*)&Packet.CRC, (int)CRCSIZE };
+		return count;
+	}
+
 	char* GenPacket()
 	{
 		int totalSize = HEADERSIZE + Packet.Head.Length + CRCSIZE;
@@ -274,8 +391,8 @@ public:
 		RawBuffer = new char[totalSize];
 		int offset = 0;
 
-		// copy header
-		memcpy(RawBuffer + offset, &Packet.Head, HEADERSIZE);
+		// encode header
+		HeaderCodec::Encode(Packet.Head, (unsigned char*)RawBuffer + offset);
 		offset += HEADERSIZE;
 
 		// copy body if exists
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <functional>
+
+using namespace std;
+
+// a token bucket in one atomic word (GCRA form). instead of counting tokens it
+// keeps the theoretical arrival time: the moment the bucket would be full
+// again. taking a token pushes that time out by one interval, and is refused
+// when it would land more than a burst ahead of now. a CAS loop, no lock
+class TokenBucket
+{
+private:
+	atomic<long long> Tat;   // theoretical arrival time, ns on the steady clock
+
+public:
+	TokenBucket() {
+		Tat = 0;
+	}
+
+	static long long Now() {
+		return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// rate tokens per second, up to burst at once
+	bool TryTake(double rate, double burst, long long now = Now()) {
+		long long interval = (long long)(1e9 / rate);
+		long long window = (long long)(1e9 * burst / rate);
+
+		long long tat = Tat.load(memory_order_relaxed);
+		while (true) {
+			long long next = (tat > now ? tat : now) + interval;
+			if (next - now > window) return false;
+			if (Tat.compare_exchange_weak(tat, next, memory_order_relaxed)) return true;
+		}
+	}
+
+	// start over with a full bucket
+	void Reset() {
+		Tat.store(0, memory_order_relaxed);
+	}
+
+	// time the bucket was last drawn from past full, ns (0 if never)
+	long long IdleSince() const {
+		return Tat.load(memory_order_relaxed);
+	}
+};
+
+// how long a bucket must sit full before its slot may go to another key (s)
+#define RATE_IDLE_S 60
+
+// token buckets by key (client address, robot) in a fixed open-addressed
+// table, so lookups never lock or allocate. a key claims a free or long-idle
+// slot with one CAS on the slot's hash. if the table is full the key shares
+// the last slot it probed, which errs towards limiting
+template<int Slots>
+class BucketTable
+{
+private:
+	struct Slot {
+		atomic<size_t> Key;   // hash of the key, 0 = free
+		TokenBucket Bucket;
+		Slot() : Key(0) {}
+	};
+
+	Slot Table[Slots];
+
+	// linear probes before giving up and sharing
+	static constexpr int MaxProbe = 16;
+
+public:
+	TokenBucket& Find(const string& key) {
+		size_t code = hash<string>()(key);
+		if (code == 0) code = 1;
+
+		long long idleBefore = TokenBucket::Now() - (long long)RATE_IDLE_S * 1000000000LL;
+		size_t start = code % Slots;
+		Slot* slot = nullptr;
+		for (int i = 0; i < MaxProbe; i++) {
+			slot = &Table[(start + i) % Slots];
+			size_t held = slot->Key.load(memory_order_acquire);
+			if (held == code) return slot->Bucket;
+			if (held == 0 || slot->Bucket.IdleSince() < idleBefore) {
+				if (slot->Key.compare_exchange_strong(held, code, memory_order_acq_rel)) {
+					slot->Bucket.Reset();
+					return slot->Bucket;
+				}
+				if (held == code) return slot->Bucket;
+			}
+		}
+		return slot->Bucket;
+	}
+
+	bool TryTake(const string& key, double rate, double burst) {
+		return Find(key).TryTake(rate, burst);
+	}
+};
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <cstring>
+#include <random>
+#include <iostream>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "PktDef.h"
+
+using namespace std;
+
+// how long a scan collects replies when the caller does not say (ms)
+#define DISCOVER_WAIT_MS 300
+
+// the largest range one scan will probe (a /20)
+#define DISCOVER_MAX_HOSTS 4096
+
+// probes handed to the kernel per sendmmsg, and replies taken per recvmmsg
+#define DISCOVER_BATCH 64
+
+// a robot that answered a probe
+struct DiscoveredRobot {
+	string Address;
+	int Port;
+	double RttUs;      // first probe sent to this reply arriving
+};
+
+// finds robots on a subnet. every address in the range gets the same
+// telemetry request from one non-blocking socket, queued DISCOVER_BATCH at a
+// time with sendmmsg, and whatever answers with a CRC-valid acknowledgement
+// carrying the probe's packet count before the deadline is a robot. all
+// probes are in flight together, so a /24 costs about one round trip plus
+// the wait
+class RobotDiscovery
+{
+private:
+	typedef chrono::steady_clock Clock;
+
+	// queue every probe, waiting for buffer space when the socket fills up
+	static bool SendProbes(int sock, const vector<struct sockaddr_in>& targets, char* probe, int probeLen) {
+		struct iovec iov = { probe, (size_t)probeLen };
+		struct mmsghdr msgs[DISCOVER_BATCH];
+
+		size_t next = 0;
+		while (next < targets.size()) {
+			int count = 0;
+			for (; count < DISCOVER_BATCH && next + count < targets.size(); count++) {
+				memset(&msgs[count], 0, sizeof(msgs[count]));
+				msgs[count].msg_hdr.msg_name = (void*)&targets[next + count];
+				msgs[count].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+				msgs[count].msg_hdr.msg_iov = &iov;
+				msgs[count].msg_hdr.msg_iovlen = 1;
+			}
+
+			int sent = sendmmsg(sock, msgs, count, 0);
+			if (sent < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					struct pollfd fd = { sock, POLLOUT, 0 };
+					poll(&fd, 1, 10);
+					continue;
+				}
+				// an unreachable host (or a refused broadcast) only costs that one probe
+				if (errno == EHOSTUNREACH || errno == ENETUNREACH || errno == EACCES) {
+					next++;
+					continue;
+				}
+				cerr << "ERROR: Discovery probe failed: " << strerror(errno) << endl;
+				return false;
+			}
+			next += sent;
+		}
+		return true;
+	}
+
+	// true if raw is an acknowledged, CRC-valid answer to the probe
+	static bool IsReply(const char* raw, int len, unsigned short probeCount) {
+		if (len < (int)(HEADERSIZE + CRCSIZE)) return false;
+		PktDef reply(raw, len);
+		return reply.CheckCRC((char*)raw, len) && reply.GetAck() && reply.GetPktCount() == probeCount;
+	}
+
+public:
+	// "a.b.c.d/n" or a single (possibly broadcast) address into the addresses
+	// to probe. network and broadcast addresses are skipped for prefixes below /31
+	static bool ParseRange(const string& range, vector<struct in_addr>& hosts) {
+		string base = range;
+		int prefix = 32;
+		size_t slash = range.find('/');
+		if (slash != string::npos) {
+			base = range.substr(0, slash);
+			string bits = range.substr(slash + 1);
+			char* end = nullptr;
+			prefix = (int)strtol(bits.c_str(), &end, 10);
+			if (bits.empty() || *end != '\0' || prefix < 0 || prefix > 32) return false;
+		}
+
+		struct in_addr addr;
+		if (inet_pton(AF_INET, base.c_str(), &addr) != 1) return false;
+
+		unsigned long long size = 1ULL << (32 - prefix);
+		unsigned int mask = prefix == 0 ? 0 : 0xFFFFFFFFu << (32 - prefix);
+		unsigned int first = ntohl(addr.s_addr) & mask;
+		unsigned int last = first + (unsigned int)(size - 1);
+		if (prefix < 31) {
+			first++;
+			last--;
+		}
+		if ((unsigned long long)last - first + 1 > DISCOVER_MAX_HOSTS) return false;
+
+		hosts.clear();
+		for (unsigned long long host = first; host <= last; host++) {
+			struct in_addr one;
+			one.s_addr = htonl((unsigned int)host);
+			hosts.push_back(one);
+		}
+		return true;
+	}
+
+	// probe port on every host and collect the robots that answer within waitMs
+	static vector<DiscoveredRobot> Scan(const vector<struct in_addr>& hosts, int port, int waitMs = DISCOVER_WAIT_MS) {
+		vector<DiscoveredRobot> found;
+		int sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (sock < 0) {
+			cerr << "ERROR: Failed to create discovery socket: " << strerror(errno) << endl;
+			return found;
+		}
+		int on = 1;
+		setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+
+		// room for a whole burst of replies
+		int buffer = 1 << 20;
+		setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+
+		vector<struct sockaddr_in> targets(hosts.size());
+		for (size_t i = 0; i < hosts.size(); i++) {
+			memset(&targets[i], 0, sizeof(targets[i]));
+			targets[i].sin_family = AF_INET;
+			targets[i].sin_port = htons(port);
+			targets[i].sin_addr = hosts[i];
+		}
+
+		// one probe for everyone; its count tells our replies from stray traffic
+		static thread_local mt19937 rng(random_device{}());
+		unsigned short probeCount = (unsigned short)uniform_int_distribution<int>(1, 0xFFFF)(rng);
+		PktDef probe;
+		probe.SetCmd(PktDef::RESPONSE);
+		probe.SetPktCount(probeCount);
+		probe.CalcCRC();
+		int probeLen = HEADERSIZE + probe.GetLength() + CRCSIZE;
+
+		Clock::time_point start = Clock::now();
+		Clock::time_point deadline = start + chrono::milliseconds(waitMs);
+		if (!SendProbes(sock, targets, probe.GenPacket(), probeLen)) {
+			close(sock);
+			return found;
+		}
+
+		char replies[DISCOVER_BATCH][256];
+		struct sockaddr_in from[DISCOVER_BATCH];
+		struct iovec iov[DISCOVER_BATCH];
+		struct mmsghdr msgs[DISCOVER_BATCH];
+		map<unsigned int, bool> seen;
+
+		while (true) {
+			int left = (int)chrono::duration_cast<chrono::milliseconds>(deadline - Clock::now()).count();
+			if (left <= 0) break;
+			struct pollfd fd = { sock, POLLIN, 0 };
+			if (poll(&fd, 1, left) <= 0) continue;
+
+			for (int i = 0; i < DISCOVER_BATCH; i++) {
+				iov[i].iov_base = replies[i];
+				iov[i].iov_len = sizeof(replies[i]);
+				memset(&msgs[i], 0, sizeof(msgs[i]));
+				msgs[i].msg_hdr.msg_name = &from[i];
+				msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+				msgs[i].msg_hdr.msg_iov = &iov[i];
+				msgs[i].msg_hdr.msg_iovlen = 1;
+			}
+			int count = recvmmsg(sock, msgs, DISCOVER_BATCH, MSG_DONTWAIT, nullptr);
+			double rttUs = chrono::duration<double, micro>(Clock::now() - start).count();
+
+			for (int i = 0; i < count; i++) {
+				if (!IsReply(replies[i], (int)msgs[i].msg_len, probeCount)) continue;
+				if (seen[from[i].sin_addr.s_addr]) continue;
+				seen[from[i].sin_addr.s_addr] = true;
+
+				char text[INET_ADDRSTRLEN];
+				inet_ntop(AF_INET, &from[i].sin_addr, text, sizeof(text));
+				found.push_back(DiscoveredRobot{ text, ntohs(from[i].sin_port), rttUs });
+			}
+		}
+
+		close(sock);
+		return found;
+	}
+};
@@ -0,0 +1,1008 @@
+#pragma once
+
+#include <string>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <condition_variable>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include "MySocket.h"
+#include "PktDef.h"
+#include "TeleCommand.h"
+#include "MpscQueue.h"
+#include "LatencyStats.h"
+#include "HostResolver.h"
+#include "TelemetryRollup.h"
+#include "TelemetryStream.h"
+#include "Tracing.h"
+#include "PacketCapture.h"
+
+using namespace std;
+
+// how long the sender waits for a robot reply until the robot's round trips
+// have been measured (ms). after that the wait adapts, see RttEstimator
+#define REPLY_TIMEOUT_MS 500
+
+// a robot nothing has been heard from for this long is pinged (ms)
+#define HEARTBEAT_INTERVAL_MS 1000
+
+// heartbeat intervals without a word before a robot counts as dead
+#define HEARTBEAT_MISSES 3
+
+// while anyone is subscribed to a robot's telemetry stream, it is read this often (ms)
+#define TELEMETRY_STREAM_MS 250
+
+// largest reply we expect from a robot
+#define REPLY_BUFFER_SIZE 1024
+
+// packets of a motion script allowed on the wire before waiting for acks
+#define BATCH_WINDOW 8
+
+// late replies to earlier packets a round trip skips while waiting for its own
+#define STALE_REPLY_SKIP 8
+
+// estimated wait for new work (us) above which the link starts shedding it
+#define SHED_TARGET_US 250000
+
+// how long cached telemetry may stand in for a fresh reading while shedding (ms)
+#define TELEMETRY_MAX_AGE_MS 5000
+
+// consecutive unanswered round trips that open a link's circuit breaker
+#define BREAKER_THRESHOLD 3
+
+// while the breaker is open, how often the robot is probed (ms)
+#define BREAKER_PROBE_MS 1000
+
+// reply given to work refused while the breaker is open
+#define UNREACHABLE_REPLY "Robot unreachable"
+
+// one outbound channel per robot: owns the socket and the only thread that
+// touches it. request handlers push onto lock-free lanes and never block on
+// the socket; the sender serves the lanes by priority:
+//   HIGH   - sleep / stop commands, always sent next
+//   NORMAL - drive commands, a single latest-wins slot, then motion scripts
+//   LOW    - telemetry requests
+// so a stop never waits behind queued drive or telemetry traffic, only
+// behind the one round trip already on the wire. a motion script being
+// streamed gives way too: it stops at the next reply and the stop goes next.
+class RobotLink
+{
+public:
+	// opt-in low-latency mode for robots under tight closed-loop control. the
+	// sender is pinned to one core and never sleeps: it spins on its lanes and
+	// polls the socket for replies, trading a whole core for steadier round trips.
+	// pair it with LockMemory() so the spinning sender does not page fault
+	struct LinkOptions {
+		bool bLowLatency;
+		int Cpu;          // core to pin the sender to, -1 leaves it unpinned
+		int BusyPollUs;   // SO_BUSY_POLL budget, 0 leaves it off
+	};
+
+	enum Priority {
+		HIGH,
+		NORMAL,
+		LOW,
+		PRIORITY_COUNT
+	};
+
+	// called on the sender thread with the robot's reply
+	typedef function<void(const string&)> ReplyHandler;
+
+	// per-step outcome of a motion script
+	struct BatchResult {
+		vector<unsigned short> PktCounts;  // packet count stamped on each step
+		vector<bool> Acked;                // whether the robot acknowledged the step
+		vector<bool> Preempted;            // never sent: a stop cut the script short
+	};
+	typedef function<void(const BatchResult&)> BatchHandler;
+
+	// what became of a submitted drive
+	enum DriveOutcome {
+		DRIVE_QUEUED,
+		DRIVE_SUPERSEDED,     // queued, replacing a drive that had not gone out
+		DRIVE_UNREACHABLE     // dropped: the breaker is open
+	};
+
+	// circuit breaker. CLOSED sends normally; OPEN fails everything at once and
+	// sends nothing but a telemetry probe every BREAKER_PROBE_MS; HALF_OPEN is
+	// that probe on the wire, and its reply closes the breaker again
+	enum BreakerState {
+		BREAKER_CLOSED,
+		BREAKER_OPEN,
+		BREAKER_HALF_OPEN
+	};
+
+	// queue wait statistics for one lane
+	struct LaneStats {
+		unsigned long Count;     // commands taken off the lane
+		double TotalWaitUs;      // summed time spent queued
+		double MaxWaitUs;        // worst time spent queued
+	};
+
+private:
+	typedef chrono::steady_clock Clock;
+
+	// a motion script, already encoded back to back in one buffer
+	struct Batch {
+		vector<char> Wire;                 // every packet of the script
+		vector<size_t> Offsets;            // start of each packet in Wire, plus the end
+		vector<unsigned short> PktCounts;
+		BatchHandler Done;
+	};
+
+	// a queued packet and whoever is waiting for its reply. move-only, like PktDef
+	struct Outbound {
+		PktDef Pkt;                          // count and CRC are stamped when sent
+		Clock::time_point Queued;
+		ReplyHandler Reply;                  // empty for fire-and-forget drives
+		shared_ptr<Batch> Script;            // set for motion scripts
+		unsigned long TraceId = 0;           // sampled request this serves, see Tracer
+	};
+
+	string IPAddr;               // robot IP address or hostname
+	int Port;                    // robot port
+	LinkOptions Options;
+	HostResolver* Resolver;      // resolves IPAddr if it is a hostname, may be null
+	unsigned int ResolvedGen;    // resolver generation last checked, sender only
+	mutex AddressLock;
+	string Address;              // numeric address the socket sends to
+	MySocket Sock;               // UDP socket used only by the sender thread
+	char ReplyBuffer[REPLY_BUFFER_SIZE];  // replies land here, sender thread only
+	atomic<unsigned short> PktCounter;  // packet counter stamped on each packet sent
+
+	// outbound lanes: any thread pushes, only the sender pops
+	MpscQueue<Outbound> HighLane;
+	atomic<Outbound*> PendingDrive;    // latest-wins drive slot, swapped whole
+	MpscQueue<Outbound> BatchLane;     // motion scripts, after the drive slot
+	MpscQueue<Outbound> LowLane;
+	atomic<unsigned int> Signal;       // bumped after every push, the sender waits on it
+	atomic<bool> bRunning;
+
+	// single-flight telemetry: concurrent requests share one round trip. the
+	// waiters and the flight flag change together, under TelemetryLock
+	mutex TelemetryLock;
+	vector<ReplyHandler> TelemetryWaiters;
+	bool bTelemetryFlight;             // a telemetry request is queued or on the wire
+	atomic<unsigned long> TelemetryRequests;
+	atomic<unsigned long> TelemetryRoundTrips;
+
+	mutex StatsLock;                   // sender writes, stats readers read
+	LaneStats Stats[PRIORITY_COUNT];
+
+	// counters
+	atomic<unsigned long> DrivesSubmitted;
+	atomic<unsigned long> DrivesSent;
+	atomic<unsigned long> DrivesSuperseded;
+
+	mutex ReplyLock;
+	string LastReply;            // last thing the robot said
+	string LastTelemetry;        // last decoded telemetry, served while shedding
+	Clock::time_point LastTelemetryAt;
+
+	// load shedding. work ahead of a new request is what is queued or on the
+	// wire (drives excluded: the latest-wins slot never holds more than one)
+	atomic<int> InFlight;
+	RttEstimator Rtt;                  // smoothed round trip and the reply timeout it implies
+	atomic<bool> bShedding;
+	atomic<unsigned long> Shed;        // requests rejected or served from cache
+
+	// circuit breaker, driven by the sender
+	atomic<int> Breaker;               // a BreakerState
+	atomic<int> ConsecutiveTimeouts;   // sender writes, ShouldShed reads
+	Clock::time_point OpenedAt;        // sender only
+	atomic<unsigned long> BreakerTrips;
+	atomic<unsigned long> FailedFast;
+	mutex BreakerLock;                 // the open-breaker wait, so shutdown can cut it short
+	condition_variable BreakerWake;
+
+	TelemetryRollup Rollup;            // every telemetry reply, downsampled for charts
+	TelemetryStream Stream;            // and pushed to subscribers
+	PacketCapture Capture;             // the last packets both ways, sender records
+
+	// liveness
+	atomic<long long> LastHeardNs;     // steady clock, 0 if never
+	atomic<bool> bHeartbeatOut;        // a heartbeat is queued or on the wire
+	atomic<unsigned long> Heartbeats;
+	int AppliedTimeoutMs;              // the socket's receive timeout, sender only
+
+	// round trip times. with kernel timestamps the total splits into time on
+	// the network (kernel send -> kernel receive, robot included) and time in
+	// the gateway (syscalls and waking the sender)
+	bool bKernelStamps;
+	LatencyHistogram TotalRtt;
+	LatencyHistogram NetworkRtt;
+	LatencyHistogram GatewayRtt;
+
+	thread Sender;
+
+	// turn a raw reply into the text handed back to clients
+	static string DescribeReply(const string& raw) {
+		return raw.empty() ? "No response" : "Robot replied: " + raw;
+	}
+
+	// a telemetry reply decoded as JSON, or the plain description if it is not one
+	// false unless raw is a CRC-valid telemetry reply
+	static bool DecodeTelemetryReply(const string& raw, Telemetry& telem) {
+		if (raw.size() != HEADERSIZE + TELEMSIZE + CRCSIZE || (unsigned char)raw[3] != TELEMSIZE) return false;
+
+		PktDef reply(raw.data(), (int)raw.size());
+		if (!reply.CheckCRC((char*)raw.data(), (int)raw.size())) return false;
+		telem = PktDef::DecodeTelemetry(reply.GetBodyData());
+		return true;
+	}
+
+	static string DescribeTelemetry(const Telemetry& telem) {
+		return "{\"LastPktCounter\":" + to_string(telem.LastPktCounter) +
+			",\"CurrentGrade\":" + to_string(telem.CurrentGrade) +
+			",\"HitCount\":" + to_string(telem.HitCount) +
+			",\"LastCmd\":" + to_string(telem.LastCmd) +
+			",\"LastCmdValue\":" + to_string(telem.LastCmdValue) +
+			",\"LastCmdSpeed\":" + to_string(telem.LastCmdSpeed) + "}";
+	}
+
+	// when a reply to a packet sent now is given up on
+	Clock::time_point ReplyDeadline() {
+		return Clock::now() + chrono::microseconds((long long)Rtt.GetRto());
+	}
+
+	// wait for the next reply in ReplyBuffer: blocks in the kernel normally,
+	// spins on a non-blocking receive in low-latency mode. bytes received, or
+	// -1 if nothing came by deadline
+	int AwaitReply(Clock::time_point deadline) {
+		int len;
+		if (!Options.bLowLatency) {
+			// whole milliseconds, rounded up, so a fresh deadline keeps the applied timeout
+			long long remainingUs = chrono::duration_cast<chrono::microseconds>(deadline - Clock::now()).count();
+			if (remainingUs <= 0) return -1;
+			int timeoutMs = (int)((remainingUs + 999) / 1000);
+			if (timeoutMs != AppliedTimeoutMs) {
+				Sock.SetTimeout(timeoutMs);
+				AppliedTimeoutMs = timeoutMs;
+			}
+			len = Sock.GetData(span<char>(ReplyBuffer));
+		}
+		else {
+			while ((len = Sock.TryGetData(ReplyBuffer, REPLY_BUFFER_SIZE)) == 0) {
+				if (Clock::now() >= deadline) return -1;
+				CpuRelax();
+			}
+		}
+
+		if (len > 0) Capture.Record(CAPTURE_RECEIVED, ReplyBuffer, len);
+		return len;
+	}
+
+	static long long NowNs() {
+		return chrono::duration_cast<chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+	}
+
+	void Heard() {
+		LastHeardNs = NowNs();
+	}
+
+	// a CRC-valid reply to some earlier packet, which arrived after its wait ran out
+	bool IsStale(int len, unsigned short pktCount) {
+		if (len < (int)(HEADERSIZE + CRCSIZE)) return false;
+		PktDef reply(ReplyBuffer, len);
+		return reply.CheckCRC(ReplyBuffer, len) && reply.GetPktCount() != pktCount;
+	}
+
+	// send one packet and wait for the robot's reply; empty if none came
+	string RoundTrip(PktDef& pkt) {
+		// header, body and CRC go out straight from the packet in one sendmsg
+		PktDef::Fragment frags[3];
+		struct iovec iov[3];
+		int count;
+		{
+			TraceScope span("encode");
+			pkt.SetPktCount(++PktCounter);
+			pkt.CalcCRC();
+			count = pkt.GetFragments(frags);
+			for (int i = 0; i < count; i++) {
+				iov[i].iov_base = (void*)frags[i].Data;
+				iov[i].iov_len = frags[i].Size;
+			}
+		}
+		struct timespec sentAt, arrivedAt;
+		if (bKernelStamps) Sock.GetTxTimestamp(sentAt);   // drop stamps of earlier sends
+
+		Clock::time_point start = Clock::now();
+		{
+			TraceScope span("send");
+			Sock.SendData(iov, count);
+			Capture.Record(CAPTURE_SENT, iov, count);
+		}
+
+		// with tight timeouts a late reply to an earlier packet can be waiting; skip
+		// it, still within the one timeout this packet gets
+		int len;
+		{
+			TraceScope span("wait_reply");
+			Clock::time_point deadline = ReplyDeadline();
+			len = AwaitReply(deadline);
+			for (int stale = 0; len > 0 && stale < STALE_REPLY_SKIP && IsStale(len, (unsigned short)pkt.GetPktCount()); stale++) {
+				len = AwaitReply(deadline);
+			}
+		}
+		if (len <= 0) {
+			Rtt.Timeout();
+			return string();
+		}
+
+		double totalUs = chrono::duration<double, micro>(Clock::now() - start).count();
+		TotalRtt.Record(totalUs);
+		Rtt.Sample(totalUs);
+		Heard();
+		if (bKernelStamps && Sock.GetTxTimestamp(sentAt) && Sock.GetRxTimestamp(arrivedAt)) {
+			double networkUs = (arrivedAt.tv_sec - sentAt.tv_sec) * 1e6 + (arrivedAt.tv_nsec - sentAt.tv_nsec) / 1e3;
+			if (networkUs >= 0 && networkUs <= totalUs) {
+				NetworkRtt.Record(networkUs);
+				GatewayRtt.Record(totalUs - networkUs);
+			}
+		}
+
+		return string(ReplyBuffer, len);
+	}
+
+	// stream a motion script with up to BATCH_WINDOW packets in flight,
+	// matching acks to steps by packet count. a command waiting in the high
+	// lane ends the script: nothing more is sent, and the steps on the wire
+	// are not waited for
+	BatchResult RunBatch(const Batch& script) {
+		enum StepState { UNSENT, IN_FLIGHT, ACKED, LOST };
+
+		size_t steps = script.PktCounts.size();
+		vector<StepState> state(steps, UNSENT);
+		size_t next = 0;
+		size_t inFlight = 0;
+
+		while (next < steps || inFlight > 0) {
+			if (!HighLane.IsEmpty()) break;
+			while (next < steps && inFlight < BATCH_WINDOW) {
+				size_t size = script.Offsets[next + 1] - script.Offsets[next];
+				Sock.SendData(script.Wire.data() + script.Offsets[next], (int)size);
+				Capture.Record(CAPTURE_SENT, script.Wire.data() + script.Offsets[next], size);
+				state[next++] = IN_FLIGHT;
+				inFlight++;
+			}
+
+			int len = AwaitReply(ReplyDeadline());
+			if (len <= 0) {
+				// timed out: whatever is still in flight is lost, carry on with the rest
+				Rtt.Timeout();
+				for (size_t i = 0; i < next; i++) {
+					if (state[i] == IN_FLIGHT) state[i] = LOST;
+				}
+				inFlight = 0;
+				continue;
+			}
+
+			PktDef reply(ReplyBuffer, len);
+			if (!reply.GetAck() || !reply.CheckCRC(ReplyBuffer, HEADERSIZE + reply.GetLength() + CRCSIZE)) continue;
+
+			Heard();
+			unsigned short step = (unsigned short)(reply.GetPktCount() - script.PktCounts[0]);
+			// a duplicate, or an ack after the step was given up on: a LOST step stays lost
+			if (step >= next || state[step] != IN_FLIGHT) continue;
+			inFlight--;
+			state[step] = ACKED;
+		}
+
+		BatchResult result;
+		result.PktCounts = script.PktCounts;
+		for (size_t i = 0; i < steps; i++) {
+			result.Acked.push_back(state[i] == ACKED);
+			result.Preempted.push_back(state[i] == UNSENT);
+		}
+		return result;
+	}
+
+	// pop the next command by priority, sender thread only
+	bool TakeNext(Outbound& next) {
+		Priority lane;
+		Outbound* drive;
+		if (HighLane.Pop(next)) {
+			lane = HIGH;
+		}
+		else if ((drive = PendingDrive.exchange(nullptr)) != nullptr) {
+			next = move(*drive);
+			delete drive;
+			lane = NORMAL;
+		}
+		else if (BatchLane.Pop(next)) {
+			lane = NORMAL;
+		}
+		else if (LowLane.Pop(next)) {
+			lane = LOW;
+		}
+		else {
+			return false;
+		}
+
+		double waitUs = chrono::duration<double, micro>(Clock::now() - next.Queued).count();
+		lock_guard<mutex> lock(StatsLock);
+		Stats[lane].Count++;
+		Stats[lane].TotalWaitUs += waitUs;
+		if (waitUs > Stats[lane].MaxWaitUs) Stats[lane].MaxWaitUs = waitUs;
+		return true;
+	}
+
+	// low-latency mode: move the sender onto its core before it serves anything
+	void PinSender() {
+		if (Options.Cpu < 0) return;
+#ifdef __linux__
+		if (!IsAllowedCpu(Options.Cpu)) {
+			cerr << "ERROR: Failed to pin sender to CPU " << Options.Cpu << ": not a CPU this process may use" << endl;
+			return;
+		}
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(Options.Cpu, &cpus);
+		int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+		if (err != 0) {
+			cerr << "ERROR: Failed to pin sender to CPU " << Options.Cpu << ": " << strerror(err) << endl;
+		}
+#else
+		cerr << "ERROR: CPU pinning is not supported on this platform" << endl;
+#endif
+	}
+
+	// where a new link first points: the cached resolution of a hostname, or
+	// the address itself
+	static string InitialAddress(const string& host, HostResolver* resolver) {
+		vector<string> addrs;
+		if (resolver && resolver->GetCached(host, addrs)) return addrs[0];
+		return host;
+	}
+
+	// follow the robot if its name now resolves somewhere else. only the
+	// sender touches the socket, so the switch happens here between round trips
+	void FollowAddress() {
+		if (!Resolver) return;
+		unsigned int gen = Resolver->GetGeneration();
+		if (gen == ResolvedGen) return;
+		ResolvedGen = gen;
+
+		vector<string> addrs;
+		if (!Resolver->GetCached(IPAddr, addrs)) return;
+
+		string current = GetAddress();
+		if (find(addrs.begin(), addrs.end(), current) != addrs.end()) return;
+
+		// the socket is bound to one family, so take the first address in it
+		int family = Sock.GetFamily();
+		for (const string& addr : addrs) {
+			if ((addr.find(':') != string::npos) != (family == AF_INET6)) continue;
+			Sock.SetIPAddr(addr);
+			lock_guard<mutex> lock(AddressLock);
+			Address = addr;
+			return;
+		}
+		cerr << "ERROR: " << IPAddr << " no longer resolves to an address of the link's family" << endl;
+	}
+
+	// an unanswered round trip counts toward opening the breaker, an answer resets it
+	void RecordOutcome(bool answered) {
+		if (answered) {
+			ConsecutiveTimeouts = 0;
+			return;
+		}
+		if (++ConsecutiveTimeouts >= BREAKER_THRESHOLD) {
+			Breaker = BREAKER_OPEN;
+			OpenedAt = Clock::now();
+			BreakerTrips++;
+			cerr << "ERROR: " << IPAddr << ":" << Port << " unreachable, circuit breaker open" << endl;
+		}
+	}
+
+	// breaker open: fail whatever slipped into the lanes, sleep until the next
+	// probe is due, then try one telemetry round trip
+	void WaitAndProbe() {
+		FailPending(UNREACHABLE_REPLY);
+		{
+			unique_lock<mutex> lock(BreakerLock);
+			BreakerWake.wait_until(lock, OpenedAt + chrono::milliseconds(BREAKER_PROBE_MS), [this] { return !bRunning; });
+		}
+		if (!bRunning) return;
+
+		Breaker = BREAKER_HALF_OPEN;
+		FollowAddress();
+		PktDef probe;
+		probe.SetCmd(PktDef::RESPONSE);
+		bool answered = !RoundTrip(probe).empty();
+		if (answered) {
+			ConsecutiveTimeouts = 0;
+			Breaker = BREAKER_CLOSED;
+			cerr << "ERROR: " << IPAddr << ":" << Port << " answering again, circuit breaker closed" << endl;
+		}
+		else {
+			Breaker = BREAKER_OPEN;
+			OpenedAt = Clock::now();
+		}
+	}
+
+	// true (and counted) if new work must be refused because the breaker is open
+	bool FailFast() {
+		if (Breaker == BREAKER_CLOSED) return false;
+		FailedFast++;
+		return true;
+	}
+
+	// drains the lanes until the link is shut down
+	void SenderLoop() {
+		if (Options.bLowLatency) PinSender();
+		Tracer::NameThread("sender " + IPAddr + ":" + to_string(Port));
+
+		while (bRunning) {
+			if (Breaker != BREAKER_CLOSED) {
+				WaitAndProbe();
+				continue;
+			}
+
+			// read the signal before looking, so a push after an empty look still wakes us
+			unsigned int seen = Signal.load();
+			Outbound next;
+			if (!TakeNext(next)) {
+				if (Options.bLowLatency) CpuRelax();
+				else Signal.wait(seen);
+				continue;
+			}
+
+			// the rest of this round works for the request that queued the packet
+			TraceContext trace(next.TraceId);
+			Tracer::Record("queued", chrono::duration_cast<chrono::nanoseconds>(next.Queued.time_since_epoch()).count(), Tracer::NowNs());
+
+			FollowAddress();
+			if (next.Script) {
+				BatchResult result;
+				{
+					TraceScope span("batch");
+					result = RunBatch(*next.Script);
+				}
+				// a script cut short before anything was answered says nothing about the robot
+				bool acked = find(result.Acked.begin(), result.Acked.end(), true) != result.Acked.end();
+				bool preempted = find(result.Preempted.begin(), result.Preempted.end(), true) != result.Preempted.end();
+				if (acked || !preempted) RecordOutcome(acked);
+				next.Script->Done(result);
+				InFlight--;
+				continue;
+			}
+
+			string raw = RoundTrip(next.Pkt);
+			RecordOutcome(!raw.empty());
+			string reply;
+			{
+				TraceScope span("decode");
+				Telemetry telem;
+				if (next.Pkt.GetCmd() == PktDef::RESPONSE && DecodeTelemetryReply(raw, telem)) {
+					Rollup.Record(telem);
+					Stream.Publish(telem);
+					reply = DescribeTelemetry(telem);
+				}
+				else {
+					reply = DescribeReply(raw);
+				}
+			}
+
+			if (next.Pkt.GetCmd() == PktDef::DRIVE) DrivesSent++;
+			else InFlight--;
+			if (next.Reply) next.Reply(reply);
+
+			lock_guard<mutex> lock(ReplyLock);
+			LastReply = reply;
+		}
+	}
+
+	// tell the sender there is work
+	void Wake() {
+		Signal++;
+		Signal.notify_one();
+	}
+
+	// a drive that will never be sent: tell whoever waits on it why
+	void DropDrive(Outbound* drive, const string& reason) {
+		if (drive->Reply) drive->Reply(reason);
+		delete drive;
+	}
+
+	// queue a command that someone waits on
+	void Enqueue(PktDef::CmdType cmd, Priority lane, ReplyHandler onReply) {
+		Outbound out;
+		out.Pkt.SetCmd(cmd);
+		out.Queued = Clock::now();
+		out.Reply = onReply;
+		out.TraceId = Tracer::Current();
+
+		InFlight++;
+		if (lane == HIGH) {
+			// a stop makes any drive that has not gone out yet moot
+			Outbound* drive = PendingDrive.exchange(nullptr);
+			if (drive) {
+				DropDrive(drive, "Superseded");
+				DrivesSuperseded++;
+			}
+			HighLane.Push(move(out));
+		}
+		else {
+			LowLane.Push(move(out));
+		}
+		Wake();
+	}
+
+	// everyone attached to the telemetry flight, which is closed as they are
+	// taken: a request arriving after this starts a fresh flight
+	vector<ReplyHandler> TakeTelemetryWaiters() {
+		vector<ReplyHandler> waiters;
+		lock_guard<mutex> lock(TelemetryLock);
+		waiters.swap(TelemetryWaiters);
+		bTelemetryFlight = false;
+		return waiters;
+	}
+
+	// the one telemetry round trip in flight is done: close it, then answer
+	// everyone who attached to it
+	void CompleteTelemetry(const string& reply) {
+		if (!reply.empty() && reply[0] == '{') {
+			lock_guard<mutex> lock(ReplyLock);
+			LastTelemetry = reply;
+			LastTelemetryAt = Clock::now();
+		}
+
+		for (ReplyHandler& waiter : TakeTelemetryWaiters()) waiter(reply);
+	}
+
+	// answer everything queued without sending it: once the sender has
+	// stopped, or from the sender while the breaker is open
+	void FailPending(const string& reason) {
+		// each answered item leaves InFlight once, as if it had been sent; a
+		// producer that counted itself in but has not pushed yet keeps its count
+		Outbound out;
+		while (HighLane.Pop(out)) {
+			out.Reply(reason);
+			InFlight--;
+		}
+		while (BatchLane.Pop(out)) {
+			size_t steps = out.Script->PktCounts.size();
+			out.Script->Done(BatchResult{ out.Script->PktCounts, vector<bool>(steps, false), vector<bool>(steps, false) });
+			InFlight--;
+		}
+		while (LowLane.Pop(out)) {
+			out.Reply(reason);
+			InFlight--;
+		}
+		Outbound* drive = PendingDrive.exchange(nullptr);
+		if (drive) DropDrive(drive, reason);
+
+		for (ReplyHandler& waiter : TakeTelemetryWaiters()) waiter(reason);
+	}
+
+public:
+	// tell the core we are spinning, so a sibling hyperthread gets the pipeline
+	static void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#elif defined(__aarch64__)
+		asm volatile("yield");
+#endif
+	}
+
+	// lock the whole process into RAM so a spinning sender never takes a page
+	// fault. process-wide, so left to whoever owns the process to opt into;
+	// once per process, failure (usually RLIMIT_MEMLOCK) is not fatal
+	static void LockMemory() {
+		static once_flag locked;
+		call_once(locked, [] {
+			if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+				cerr << "ERROR: Failed to lock memory: " << strerror(errno) << endl;
+			}
+		});
+	}
+
+	// whether a sender may be pinned to cpu: a core in this process's affinity mask
+	static bool IsAllowedCpu(int cpu) {
+#ifdef __linux__
+		if (cpu < 0 || cpu >= CPU_SETSIZE) return false;
+		cpu_set_t allowed;
+		CPU_ZERO(&allowed);
+		if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) return false;
+		return CPU_ISSET(cpu, &allowed);
+#else
+		return false;
+#endif
+	}
+
+	// ipAddress may be a hostname when a resolver is given; the link then
+	// keeps it resolved and follows it to new addresses
+	RobotLink(string ipAddress, int portNumber, LinkOptions options = LinkOptions{ false, -1, 0 }, HostResolver* resolver = nullptr)
+		: IPAddr(ipAddress), Port(portNumber), Options(options), Resolver(resolver), Address(InitialAddress(ipAddress, resolver)),
+		Sock(CLIENT, Address, portNumber, UDP, REPLY_BUFFER_SIZE), Rtt(REPLY_TIMEOUT_MS) {
+		ResolvedGen = Resolver ? Resolver->GetGeneration() : 0;
+		if (Resolver) Resolver->Watch(IPAddr);
+		PktCounter = 0;
+		PendingDrive = nullptr;
+		Signal = 0;
+		bRunning = true;
+		bTelemetryFlight = false;
+		TelemetryRequests = 0;
+		TelemetryRoundTrips = 0;
+		DrivesSubmitted = 0;
+		DrivesSent = 0;
+		DrivesSuperseded = 0;
+		InFlight = 0;
+		LastHeardNs = 0;
+		bHeartbeatOut = false;
+		Heartbeats = 0;
+		bShedding = false;
+		Shed = 0;
+		Breaker = BREAKER_CLOSED;
+		ConsecutiveTimeouts = 0;
+		BreakerTrips = 0;
+		FailedFast = 0;
+		LastReply = "No response";
+		for (int i = 0; i < PRIORITY_COUNT; i++) {
+			Stats[i] = LaneStats{ 0, 0.0, 0.0 };
+		}
+
+		AppliedTimeoutMs = Rtt.GetRtoMs();
+		Sock.SetTimeout(AppliedTimeoutMs);
+		bKernelStamps = Sock.EnableTimestamps();
+		if (Options.bLowLatency) {
+			// no console I/O on the hot path
+			Sock.SetVerbose(false);
+			if (Options.BusyPollUs > 0) Sock.SetBusyPoll(Options.BusyPollUs);
+		}
+		Sender = thread(&RobotLink::SenderLoop, this);
+	}
+
+	~RobotLink() {
+		{
+			lock_guard<mutex> lock(BreakerLock);
+			bRunning = false;
+		}
+		BreakerWake.notify_all();
+		Wake();
+		Sender.join();
+		FailPending("Link closed");
+		if (Resolver) Resolver->Unwatch(IPAddr);
+	}
+
+	RobotLink(const RobotLink&) = delete;
+	RobotLink& operator=(const RobotLink&) = delete;
+
+	// queue a drive command, replacing any drive that has not been sent yet.
+	// onReply, if given, gets the robot's reply, or "Superseded" if a later
+	// command replaced this one, or UNREACHABLE_REPLY if it was never queued
+	DriveOutcome SubmitDrive(const DriveBody& body, ReplyHandler onReply = nullptr) {
+		if (FailFast()) {
+			if (onReply) onReply(UNREACHABLE_REPLY);
+			return DRIVE_UNREACHABLE;
+		}
+
+		Outbound* drive = new Outbound();
+		drive->Pkt.SetCmd(PktDef::DRIVE);
+		drive->Pkt.SetBodyData((char*)&body, DRIVEBODYSIZE);
+		drive->Queued = Clock::now();
+		drive->Reply = onReply;
+		drive->TraceId = Tracer::Current();
+
+		Outbound* old = PendingDrive.exchange(drive);
+		Wake();
+
+		DrivesSubmitted++;
+		if (old) {
+			DropDrive(old, "Superseded");
+			DrivesSuperseded++;
+			return DRIVE_SUPERSEDED;
+		}
+		return DRIVE_QUEUED;
+	}
+
+	// sleep goes in the high lane, ahead of everything else queued
+	void SubmitSleep(ReplyHandler onReply) {
+		if (FailFast()) {
+			onReply(UNREACHABLE_REPLY);
+			return;
+		}
+		Enqueue(PktDef::SLEEP, HIGH, onReply);
+	}
+
+	// telemetry requests yield to commands. requests that arrive while one is
+	// already queued or in flight attach to it and all get the same decoded reply
+	void SubmitTelemetry(ReplyHandler onReply) {
+		if (FailFast()) {
+			onReply(UNREACHABLE_REPLY);
+			return;
+		}
+		TelemetryRequests++;
+		{
+			lock_guard<mutex> lock(TelemetryLock);
+			TelemetryWaiters.push_back(onReply);
+			if (bTelemetryFlight) return;
+			bTelemetryFlight = true;
+		}
+
+		TelemetryRoundTrips++;
+		Enqueue(PktDef::RESPONSE, LOW, [this](const string& reply) { CompleteTelemetry(reply); });
+	}
+
+	// encode a motion script into one buffer now and queue it behind the drive slot.
+	// steps must be DRIVE or SLEEP commands
+	void SubmitBatch(const vector<TeleCommand>& steps, BatchHandler onDone) {
+		if (FailFast()) {
+			onDone(BatchResult{ vector<unsigned short>(steps.size(), 0), vector<bool>(steps.size(), false), vector<bool>(steps.size(), false) });
+			return;
+		}
+
+		shared_ptr<Batch> script = make_shared<Batch>();
+		script->Done = onDone;
+		script->Wire.reserve(steps.size() * (HEADERSIZE + DRIVEBODYSIZE + CRCSIZE));
+
+		// reserve a run of packet counts so acks map straight back to steps
+		unsigned short first = PktCounter.fetch_add((unsigned short)steps.size()) + 1;
+		for (size_t i = 0; i < steps.size(); i++) {
+			PktDef pkt;
+			pkt.SetCmd(steps[i].Cmd);
+			if (steps[i].Cmd == PktDef::DRIVE) {
+				pkt.SetBodyData((char*)&steps[i].Body, DRIVEBODYSIZE);
+			}
+			pkt.SetPktCount((unsigned short)(first + i));
+			pkt.CalcCRC();
+
+			char* raw = pkt.GenPacket();
+			script->Offsets.push_back(script->Wire.size());
+			script->Wire.insert(script->Wire.end(), raw, raw + HEADERSIZE + pkt.GetLength() + CRCSIZE);
+			script->PktCounts.push_back((unsigned short)(first + i));
+		}
+		script->Offsets.push_back(script->Wire.size());
+
+		Outbound out;
+		out.Queued = Clock::now();
+		out.Script = script;
+		out.TraceId = Tracer::Current();
+		InFlight++;
+		BatchLane.Push(move(out));
+		Wake();
+	}
+
+	// whether new non-urgent work should be turned away: the estimated wait,
+	// work in flight times what each item costs, is over SHED_TARGET_US. an
+	// item costs the smoothed round trip while the robot answers, and the whole
+	// reply timeout once round trips time out, so a link degrading through
+	// timeouts sheds too. once shedding, it carries on until the estimate is
+	// under half the target
+	bool ShouldShed() {
+		double itemUs = ConsecutiveTimeouts.load() > 0 ? Rtt.GetRto() : Rtt.GetSrtt();
+		double waitUs = InFlight.load() * itemUs;
+		bool shedding = bShedding.load();
+		bool next = shedding;
+		if (!shedding && waitUs > SHED_TARGET_US) next = true;
+		else if (shedding && waitUs < SHED_TARGET_US / 2) next = false;
+
+		// callers racing over the same edge flip it once; the losers take the winner's answer
+		if (next != shedding && !bShedding.compare_exchange_strong(shedding, next)) return shedding;
+		return next;
+	}
+
+	// count a request that was rejected or degraded
+	void CountShed() { Shed++; }
+
+	// ping the robot if it has been quiet for a heartbeat interval, so its
+	// round trip estimate and liveness stay current while nothing else is sent.
+	// an open breaker probes on its own
+	void Heartbeat() {
+		if (Breaker != BREAKER_CLOSED) return;
+
+		// stream subscribers want readings more often than liveness needs
+		if (Stream.GetSubscribers() > 0) {
+			long long ageMs;
+			{
+				lock_guard<mutex> lock(ReplyLock);
+				ageMs = LastTelemetry.empty() ? -1 : chrono::duration_cast<chrono::milliseconds>(Clock::now() - LastTelemetryAt).count();
+			}
+			if (ageMs < 0 || ageMs >= TELEMETRY_STREAM_MS) {
+				SubmitTelemetry([](const string&) {});
+				return;
+			}
+		}
+
+		long long heard = LastHeardNs;
+		if (heard != 0 && NowNs() - heard < HEARTBEAT_INTERVAL_MS * 1000000LL) return;
+		if (bHeartbeatOut.exchange(true)) return;
+
+		Heartbeats++;
+		Enqueue(PktDef::RESPONSE, LOW, [this](const string&) { bHeartbeatOut = false; });
+	}
+
+	// ms since the robot last answered anything, -1 if it never has
+	long long GetSilentMs() const {
+		long long heard = LastHeardNs;
+		if (heard == 0) return -1;
+		return (NowNs() - heard) / 1000000;
+	}
+
+	bool IsAlive() const {
+		long long silentMs = GetSilentMs();
+		return silentMs >= 0 && silentMs < HEARTBEAT_INTERVAL_MS * HEARTBEAT_MISSES;
+	}
+
+	unsigned long GetHeartbeats() const { return Heartbeats; }
+
+	// the last telemetry reading and its age, if one is recent enough to serve
+	bool GetCachedTelemetry(string& telemetry, long long& ageMs) {
+		lock_guard<mutex> lock(ReplyLock);
+		if (LastTelemetry.empty()) return false;
+		ageMs = chrono::duration_cast<chrono::milliseconds>(Clock::now() - LastTelemetryAt).count();
+		if (ageMs > TELEMETRY_MAX_AGE_MS) return false;
+		telemetry = LastTelemetry;
+		return true;
+	}
+
+	BreakerState GetBreakerState() const { return (BreakerState)Breaker.load(); }
+	unsigned long GetBreakerTrips() const { return BreakerTrips; }
+	unsigned long GetFailedFast() const { return FailedFast; }
+
+	int GetInFlight() const { return InFlight; }
+	const RttEstimator& GetRtt() const { return Rtt; }
+	TelemetryRollup& GetRollup() { return Rollup; }
+	TelemetryStream& GetStream() { return Stream; }
+	const PacketCapture& GetCapture() const { return Capture; }
+	unsigned long GetShed() const { return Shed; }
+
+	string GetIPAddr() const { return IPAddr; }
+	int GetPort() const { return Port; }
+	LinkOptions GetOptions() const { return Options; }
+
+	string GetAddress() {
+		lock_guard<mutex> lock(AddressLock);
+		return Address;
+	}
+
+	// this end and the robot's, as the captured packets travelled between them
+	CaptureEndpoints GetCaptureEndpoints() {
+		CaptureEndpoints ends;
+		memset(&ends, 0, sizeof(ends));
+		Sock.GetLocalAddress(ends.Local);
+
+		string address = GetAddress();
+		struct sockaddr_in6* robot6 = (struct sockaddr_in6*)&ends.Robot;
+		struct sockaddr_in* robot4 = (struct sockaddr_in*)&ends.Robot;
+		if (inet_pton(AF_INET6, address.c_str(), &robot6->sin6_addr) == 1) {
+			ends.Family = AF_INET6;
+			robot6->sin6_port = htons(Port);
+		}
+		else {
+			ends.Family = AF_INET;
+			inet_pton(AF_INET, address.c_str(), &robot4->sin_addr);
+			robot4->sin_port = htons(Port);
+		}
+		ends.Local.ss_family = ends.Robot.ss_family = ends.Family;
+		return ends;
+	}
+
+	unsigned long GetDrivesSubmitted() const { return DrivesSubmitted; }
+	unsigned long GetDrivesSent() const { return DrivesSent; }
+	unsigned long GetDrivesSuperseded() const { return DrivesSuperseded; }
+	unsigned long GetTelemetryRequests() const { return TelemetryRequests; }
+	unsigned long GetTelemetryRoundTrips() const { return TelemetryRoundTrips; }
+
+	bool HasKernelTimestamps() const { return bKernelStamps; }
+	const LatencyHistogram& GetTotalRtt() const { return TotalRtt; }
+	const LatencyHistogram& GetNetworkRtt() const { return NetworkRtt; }
+	const LatencyHistogram& GetGatewayRtt() const { return GatewayRtt; }
+
+	LaneStats GetLaneStats(Priority lane) {
+		lock_guard<mutex> lock(StatsLock);
+		return Stats[lane];
+	}
+
+	string GetLastReply() {
+		lock_guard<mutex> lock(ReplyLock);
+		return LastReply;
+	}
+};
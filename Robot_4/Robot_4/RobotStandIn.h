@@ -0,0 +1,120 @@
+#pragma once
+
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "PktDef.h"
+
+using namespace std;
+
+// a minimal robot on the loopback interface, for benchmarks and tests. it
+// acknowledges every command with the same packet count and answers telemetry
+// requests with a telemetry body, optionally after a fixed delay
+class RobotStandIn
+{
+private:
+	int Sock;
+	int Port;
+	int ReplyDelayUs;
+	atomic<bool> bRunning;
+	atomic<unsigned long> Received;
+	atomic<unsigned long> DropFirst;   // replies to packets DropFirst.. DropLast (1-based) are not sent
+	atomic<unsigned long> DropLast;
+	atomic<unsigned long> SlowNth;     // the reply to this packet waits SlowDelayUs instead
+	atomic<int> SlowDelayUs;
+	thread Worker;
+
+	void Serve() {
+		char buffer[256];
+		while (bRunning) {
+			struct sockaddr_in from;
+			socklen_t fromLen = sizeof(from);
+			int len = recvfrom(Sock, buffer, sizeof(buffer), 0, (struct sockaddr*)&from, &fromLen);
+			if (len < (int)(HEADERSIZE + CRCSIZE)) continue;   // timeout, so bRunning is checked again
+			unsigned long n = ++Received;
+
+			PktDef cmd(buffer, len);
+			if (!cmd.CheckCRC(buffer, len)) continue;
+			if (n >= DropFirst && n <= DropLast) continue;
+
+			PktDef reply;
+			reply.SetCmd(PktDef::RESPONSE);
+			reply.SetPktCount(cmd.GetPktCount());
+			if (cmd.GetCmd() == PktDef::RESPONSE) {
+				Telemetry telem = { (unsigned short)cmd.GetPktCount(), 0, (unsigned short)Received, 0, 0, 0 };
+				char body[TELEMSIZE];
+				PktDef::EncodeTelemetry(telem, body);
+				reply.SetBodyData(body, TELEMSIZE);
+			}
+			reply.CalcCRC();
+
+			int delayUs = (n == SlowNth) ? SlowDelayUs.load() : ReplyDelayUs;
+			if (delayUs > 0) this_thread::sleep_for(chrono::microseconds(delayUs));
+			sendto(Sock, reply.GenPacket(), HEADERSIZE + reply.GetLength() + CRCSIZE, 0, (struct sockaddr*)&from, fromLen);
+		}
+	}
+
+public:
+	// port 0 picks a free port, see GetPort()
+	RobotStandIn(int port = 0, int replyDelayUs = 0) : Port(port), ReplyDelayUs(replyDelayUs) {
+		bRunning = true;
+		Received = 0;
+		DropFirst = 1;
+		DropLast = 0;
+		SlowNth = 0;
+		SlowDelayUs = 0;
+
+		Sock = socket(AF_INET, SOCK_DGRAM, 0);
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+		if (bind(Sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+			cerr << "ERROR: Robot stand-in failed to bind: " << strerror(errno) << endl;
+		}
+
+		socklen_t addrLen = sizeof(addr);
+		getsockname(Sock, (struct sockaddr*)&addr, &addrLen);
+		Port = ntohs(addr.sin_port);
+
+		// wake up now and then to notice shutdown
+		struct timeval tv = { 0, 100000 };
+		setsockopt(Sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+		Worker = thread(&RobotStandIn::Serve, this);
+	}
+
+	~RobotStandIn() {
+		bRunning = false;
+		Worker.join();
+		close(Sock);
+	}
+
+	RobotStandIn(const RobotStandIn&) = delete;
+	RobotStandIn& operator=(const RobotStandIn&) = delete;
+
+	int GetPort() const { return Port; }
+	unsigned long GetReceived() const { return Received; }
+
+	// answer the nth packet received (counting from 1) only after delayUs
+	void DelayReply(unsigned long nth, int delayUs) {
+		SlowDelayUs = delayUs;
+		SlowNth = nth;
+	}
+
+	// leave the replies to the first..last packets received (counting from 1) unanswered
+	void DropReplies(unsigned long first, unsigned long last) {
+		DropLast = 0;
+		DropFirst = first;
+		DropLast = last;
+	}
+};
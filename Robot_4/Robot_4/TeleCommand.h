@@ -0,0 +1,87 @@
+#pragma once
+
+#include <string_view>
+#include <charconv>
+#include <cstring>
+#include "PktDef.h"
+
+using namespace std;
+
+// default speed for drive commands that do not carry one
+#define DEFAULT_SPEED 100
+
+// a parsed /telecommand/ body
+struct TeleCommand {
+	PktDef::CmdType Cmd;   // DRIVE or SLEEP
+	DriveBody Body;        // valid when Cmd == DRIVE
+};
+
+enum ParseResult {
+	PARSE_OK,
+	PARSE_MALFORMED,       // missing ',' or wrong binary size
+	PARSE_BAD_DIRECTION,   // unknown direction name or code
+	PARSE_BAD_DURATION     // not a number or does not fit in a byte
+};
+
+// direction names accepted in text commands
+struct DirectionName {
+	string_view Name;
+	unsigned char Code;
+};
+
+constexpr DirectionName Directions[] = {
+	{ "Forward", FORWARD },
+	{ "Backward", BACKWARD },
+	{ "Right", RIGHT },
+	{ "Left", LEFT }
+};
+
+// map a direction name to its code, 0 if unknown
+constexpr unsigned char LookupDirection(string_view name) {
+	for (const DirectionName& dir : Directions) {
+		if (dir.Name == name) return dir.Code;
+	}
+	return 0;
+}
+
+static_assert(LookupDirection("Forward") == FORWARD, "direction table out of sync");
+static_assert(LookupDirection("Left") == LEFT, "direction table out of sync");
+static_assert(LookupDirection("Up") == 0, "unknown directions must map to 0");
+
+// parse a text command like "Forward,10" or "Sleep" without copying or throwing
+inline ParseResult ParseTeleCommand(string_view text, TeleCommand& out) {
+	if (text == "Sleep") {
+		out.Cmd = PktDef::SLEEP;
+		return PARSE_OK;
+	}
+
+	size_t comma = text.find(',');
+	if (comma == string_view::npos) return PARSE_MALFORMED;
+
+	unsigned char dir = LookupDirection(text.substr(0, comma));
+	if (dir == 0) return PARSE_BAD_DIRECTION;
+
+	string_view durStr = text.substr(comma + 1);
+	unsigned int dur = 0;
+	from_chars_result res = from_chars(durStr.data(), durStr.data() + durStr.size(), dur);
+	if (res.ec != errc() || res.ptr != durStr.data() + durStr.size() || dur > 255) return PARSE_BAD_DURATION;
+
+	out.Cmd = PktDef::DRIVE;
+	out.Body.Direction = dir;
+	out.Body.Duration = (unsigned char)dur;
+	out.Body.Speed = DEFAULT_SPEED;
+	return PARSE_OK;
+}
+
+// parse an application/octet-stream body holding a raw DriveBody
+inline ParseResult ParseDriveBody(string_view bytes, TeleCommand& out) {
+	if (bytes.size() != DRIVEBODYSIZE) return PARSE_MALFORMED;
+
+	DriveBody body;
+	memcpy(&body, bytes.data(), DRIVEBODYSIZE);
+	if (body.Direction < FORWARD || body.Direction > LEFT) return PARSE_BAD_DIRECTION;
+
+	out.Cmd = PktDef::DRIVE;
+	out.Body = body;
+	return PARSE_OK;
+}
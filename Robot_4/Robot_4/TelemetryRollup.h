@@ -0,0 +1,137 @@
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include "PktDef.h"
+
+using namespace std;
+
+// telemetry fields kept in rollups, in Telemetry order
+#define ROLLUP_FIELDS 5
+
+// rollup tiers, finest first
+#define ROLLUP_TIERS 3
+
+// one field over one bucket
+struct FieldRollup {
+	unsigned short Min;
+	unsigned short Max;
+	unsigned short Last;
+	unsigned long long Sum;
+};
+
+// every reading that arrived within one bucket
+struct RollupBucket {
+	long long StartS;        // wall clock, seconds since the epoch
+	unsigned int Count;
+	FieldRollup Fields[ROLLUP_FIELDS];
+};
+
+// telemetry downsampled as it arrives, for charts over long ranges. each
+// reading is folded into the current bucket of every tier, so a query never
+// touches raw readings: it reads the coarsest tier that still gives the
+// resolution asked for. each tier is a ring; a bucket is reused once it is a
+// full ring old
+class TelemetryRollup
+{
+public:
+	// bucket width (s) and buckets kept per tier: about 15 minutes at 1s,
+	// 3 hours at 10s and a day at 1 minute
+	static constexpr int WidthS[ROLLUP_TIERS] = { 1, 10, 60 };
+	static constexpr int Buckets[ROLLUP_TIERS] = { 900, 1080, 1440 };
+
+	static const char* FieldName(int field) {
+		static const char* names[ROLLUP_FIELDS] = { "CurrentGrade", "HitCount", "LastCmd", "LastCmdValue", "LastCmdSpeed" };
+		return names[field];
+	}
+
+	static long long NowS() {
+		return chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count();
+	}
+
+private:
+	mutex Lock;
+	vector<RollupBucket> Tiers[ROLLUP_TIERS];
+
+	static void Fields(const Telemetry& telem, unsigned short values[ROLLUP_FIELDS]) {
+		values[0] = telem.CurrentGrade;
+		values[1] = telem.HitCount;
+		values[2] = telem.LastCmd;
+		values[3] = telem.LastCmdValue;
+		values[4] = telem.LastCmdSpeed;
+	}
+
+public:
+	TelemetryRollup() {
+		for (int t = 0; t < ROLLUP_TIERS; t++) {
+			Tiers[t].assign(Buckets[t], RollupBucket{ -1, 0, {} });
+		}
+	}
+
+	TelemetryRollup(const TelemetryRollup&) = delete;
+	TelemetryRollup& operator=(const TelemetryRollup&) = delete;
+
+	// readings stamped before the epoch are dropped
+	void Record(const Telemetry& telem, long long nowS = NowS()) {
+		if (nowS < 0) return;
+		unsigned short values[ROLLUP_FIELDS];
+		Fields(telem, values);
+
+		lock_guard<mutex> lock(Lock);
+		for (int t = 0; t < ROLLUP_TIERS; t++) {
+			long long start = nowS - nowS % WidthS[t];
+			RollupBucket& bucket = Tiers[t][(start / WidthS[t]) % Buckets[t]];
+			if (bucket.StartS != start) {
+				bucket.StartS = start;
+				bucket.Count = 0;
+			}
+
+			for (int f = 0; f < ROLLUP_FIELDS; f++) {
+				FieldRollup& field = bucket.Fields[f];
+				if (bucket.Count == 0) {
+					field = FieldRollup{ values[f], values[f], values[f], 0 };
+				}
+				if (values[f] < field.Min) field.Min = values[f];
+				if (values[f] > field.Max) field.Max = values[f];
+				field.Last = values[f];
+				field.Sum += values[f];
+			}
+			bucket.Count++;
+		}
+	}
+
+	// the coarsest tier no wider than resolutionS (the 1s tier if none is)
+	static int TierFor(int resolutionS) {
+		int tier = 0;
+		for (int t = 1; t < ROLLUP_TIERS; t++) {
+			if (WidthS[t] <= resolutionS) tier = t;
+		}
+		return tier;
+	}
+
+	// buckets holding readings from [fromS, toS], oldest first, at the
+	// coarsest tier meeting resolutionS. returns the width used (s).
+	// nothing is kept from before the epoch, so that part of a range is empty
+	int Query(long long fromS, long long toS, int resolutionS, vector<RollupBucket>& out) {
+		int tier = TierFor(resolutionS);
+		int width = WidthS[tier];
+		out.clear();
+		if (toS < 0 || fromS > toS) return width;
+
+		// anything older than one ring has been overwritten
+		long long last = toS - toS % width;
+		long long first = fromS < 0 ? 0 : fromS - fromS % width;
+		long long oldest = last - (long long)(Buckets[tier] - 1) * width;
+		if (first < oldest) first = oldest;
+
+		// counted rather than stepped to last, so a range ending near LLONG_MAX cannot overflow
+		lock_guard<mutex> lock(Lock);
+		for (long long n = (last - first) / width; n >= 0; n--) {
+			long long start = last - n * width;
+			const RollupBucket& bucket = Tiers[tier][(start / width) % Buckets[tier]];
+			if (bucket.StartS == start && bucket.Count > 0) out.push_back(bucket);
+		}
+		return width;
+	}
+};
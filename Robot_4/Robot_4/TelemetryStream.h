@@ -0,0 +1,171 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include "PktDef.h"
+
+using namespace std;
+
+// a keyframe goes to every subscriber at least once per this many readings
+#define STREAM_KEYFRAME_EVERY 50
+
+// stream frames are one flags byte, then each field whose bit is set, in
+// this order: 16 bit fields little endian, the rest one byte each. a
+// keyframe sets STREAM_KEYFRAME and every field bit; a delta carries only
+// the fields that changed since the previous frame
+enum StreamField {
+	SF_PKT_COUNTER,      // 16 bit
+	SF_CURRENT_GRADE,    // 16 bit
+	SF_HIT_COUNT,        // 16 bit
+	SF_LAST_CMD,
+	SF_LAST_CMD_VALUE,
+	SF_LAST_CMD_SPEED,
+	STREAM_FIELDS
+};
+#define STREAM_KEYFRAME 0x80
+
+// pushes one robot's telemetry to its subscribers as it arrives. each
+// reading is encoded once, as a delta against the previous reading, and
+// that frame goes to every subscriber; a keyframe is encoded only for new
+// subscribers and every STREAM_KEYFRAME_EVERY readings. a reading that
+// changes nothing sends nothing
+class TelemetryStream
+{
+public:
+	// sends one binary frame to one subscriber
+	typedef function<void(const string& frame)> FrameSender;
+
+private:
+	struct Subscriber {
+		FrameSender Send;
+		bool bKeyed;               // has had a keyframe to apply deltas to
+	};
+
+	mutex Lock;                    // held while sending, so an unsubscribed sender is never called
+	map<unsigned long, Subscriber> Subscribers;
+	unsigned long NextId;
+	Telemetry Last;
+	bool bHaveLast;
+	int SinceKeyframe;
+	atomic<unsigned long> FramesSent;
+	atomic<unsigned long long> BytesSent;
+
+	static unsigned int Field(const Telemetry& telem, int field) {
+		switch (field) {
+		case SF_PKT_COUNTER: return telem.LastPktCounter;
+		case SF_CURRENT_GRADE: return telem.CurrentGrade;
+		case SF_HIT_COUNT: return telem.HitCount;
+		case SF_LAST_CMD: return telem.LastCmd;
+		case SF_LAST_CMD_VALUE: return telem.LastCmdValue;
+		default: return telem.LastCmdSpeed;
+		}
+	}
+
+	static bool IsWide(int field) {
+		return field <= SF_HIT_COUNT;
+	}
+
+	void SendTo(Subscriber& subscriber, const string& frame) {
+		subscriber.Send(frame);
+		FramesSent++;
+		BytesSent += frame.size();
+	}
+
+public:
+	TelemetryStream() {
+		NextId = 1;
+		bHaveLast = false;
+		SinceKeyframe = 0;
+		FramesSent = 0;
+		BytesSent = 0;
+	}
+
+	TelemetryStream(const TelemetryStream&) = delete;
+	TelemetryStream& operator=(const TelemetryStream&) = delete;
+
+	// a keyframe when previous is null, otherwise only what changed from it
+	static string Encode(const Telemetry& telem, const Telemetry* previous) {
+		string frame(1, (char)(previous ? 0 : STREAM_KEYFRAME));
+		for (int f = 0; f < STREAM_FIELDS; f++) {
+			unsigned int value = Field(telem, f);
+			if (previous && Field(*previous, f) == value) continue;
+
+			frame[0] |= (char)(1 << f);
+			frame += (char)(value & 0xFF);
+			if (IsWide(f)) frame += (char)(value >> 8);
+		}
+		return frame;
+	}
+
+	// apply one frame to state. false if it is malformed
+	static bool Decode(const string& frame, Telemetry& state) {
+		if (frame.empty()) return false;
+		unsigned char flags = (unsigned char)frame[0];
+		size_t pos = 1;
+		unsigned int values[STREAM_FIELDS];
+		for (int f = 0; f < STREAM_FIELDS; f++) {
+			values[f] = Field(state, f);
+			if (!(flags & (1 << f))) continue;
+
+			size_t width = IsWide(f) ? 2 : 1;
+			if (pos + width > frame.size()) return false;
+			values[f] = (unsigned char)frame[pos];
+			if (width == 2) values[f] |= (unsigned char)frame[pos + 1] << 8;
+			pos += width;
+		}
+		if (pos != frame.size()) return false;
+
+		state = Telemetry{ (unsigned short)values[SF_PKT_COUNTER], (unsigned short)values[SF_CURRENT_GRADE], (unsigned short)values[SF_HIT_COUNT],
+			(unsigned char)values[SF_LAST_CMD], (unsigned char)values[SF_LAST_CMD_VALUE], (unsigned char)values[SF_LAST_CMD_SPEED] };
+		return true;
+	}
+
+	// returns an id for Unsubscribe. the first frame a subscriber gets is a keyframe
+	unsigned long Subscribe(FrameSender send) {
+		lock_guard<mutex> lock(Lock);
+		unsigned long id = NextId++;
+		Subscribers[id] = Subscriber{ send, false };
+		return id;
+	}
+
+	// once this returns the subscriber's sender is not called again
+	void Unsubscribe(unsigned long id) {
+		lock_guard<mutex> lock(Lock);
+		Subscribers.erase(id);
+	}
+
+	size_t GetSubscribers() {
+		lock_guard<mutex> lock(Lock);
+		return Subscribers.size();
+	}
+
+	void Publish(const Telemetry& telem) {
+		lock_guard<mutex> lock(Lock);
+		if (!Subscribers.empty()) {
+			bool keyframeDue = !bHaveLast || ++SinceKeyframe >= STREAM_KEYFRAME_EVERY;
+			if (keyframeDue) SinceKeyframe = 0;
+
+			string keyframe;
+			string delta = keyframeDue ? string() : Encode(telem, &Last);
+			for (auto& item : Subscribers) {
+				Subscriber& subscriber = item.second;
+				if (keyframeDue || !subscriber.bKeyed) {
+					if (keyframe.empty()) keyframe = Encode(telem, nullptr);
+					SendTo(subscriber, keyframe);
+					subscriber.bKeyed = true;
+				}
+				else if (delta.size() > 1) {
+					SendTo(subscriber, delta);
+				}
+			}
+		}
+		Last = telem;
+		bHaveLast = true;
+	}
+
+	unsigned long GetFramesSent() const { return FramesSent; }
+	unsigned long long GetBytesSent() const { return BytesSent; }
+};
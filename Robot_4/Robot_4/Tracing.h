@@ -0,0 +1,265 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <cstdio>
+
+using namespace std;
+
+// requests traced by default: one in this many (0 traces none)
+#define TRACE_SAMPLE_EVERY 64
+
+// spans each thread keeps; older ones are overwritten
+#define TRACE_SPANS_PER_THREAD 2048
+
+// buffers of finished threads kept for export beyond the live ones
+#define TRACE_DEAD_THREADS 16
+
+// one timed step of one traced request
+struct TraceSpan {
+	const char* Name;          // a string literal
+	char Detail[40];           // e.g. the request url, may be empty
+	unsigned long TraceId;
+	long long StartNs;
+	long long EndNs;
+};
+
+// sampled request tracing. a request that is sampled gets a trace id, which
+// follows it from the http thread through the robot link's queue to the
+// sender and back; every span recorded while a thread carries that id is
+// kept in the thread's own ring, so recording never contends with other
+// threads. a thread with no trace id records nothing, which costs one
+// thread-local read. Export() renders everything as Chrome trace JSON
+class Tracer
+{
+private:
+	struct ThreadBuffer {
+		mutex Lock;                // owner writes, Export reads; never contended otherwise
+		string Name;
+		int Tid;
+		bool bDead = false;
+		size_t Next = 0;           // spans ever recorded
+		TraceSpan Spans[TRACE_SPANS_PER_THREAD];
+	};
+
+	// the thread's buffer, made on its first span and marked dead when it exits
+	struct ThreadSlot {
+		shared_ptr<ThreadBuffer> Buffer;
+		~ThreadSlot() {
+			if (!Buffer) return;
+			lock_guard<mutex> lock(Buffer->Lock);
+			Buffer->bDead = true;
+		}
+	};
+
+	static mutex& RegistryLock() {
+		static mutex lock;
+		return lock;
+	}
+
+	static vector<shared_ptr<ThreadBuffer>>& Registry() {
+		static vector<shared_ptr<ThreadBuffer>> buffers;
+		return buffers;
+	}
+
+	static unsigned long& CurrentId() {
+		static thread_local unsigned long id = 0;
+		return id;
+	}
+
+	static string& PendingName() {
+		static thread_local string name;
+		return name;
+	}
+
+	static ThreadBuffer& Buffer() {
+		static thread_local ThreadSlot slot;
+		if (!slot.Buffer) {
+			slot.Buffer = make_shared<ThreadBuffer>();
+			lock_guard<mutex> lock(RegistryLock());
+			vector<shared_ptr<ThreadBuffer>>& buffers = Registry();
+
+			// forget the oldest finished threads
+			size_t dead = 0;
+			for (auto& buffer : buffers) {
+				lock_guard<mutex> bufferLock(buffer->Lock);
+				if (buffer->bDead) dead++;
+			}
+			for (auto it = buffers.begin(); it != buffers.end() && dead >= TRACE_DEAD_THREADS;) {
+				bool bDead;
+				{
+					lock_guard<mutex> bufferLock((*it)->Lock);
+					bDead = (*it)->bDead;
+				}
+				if (bDead) {
+					it = buffers.erase(it);
+					dead--;
+				}
+				else {
+					++it;
+				}
+			}
+
+			static int nextTid = 1;
+			slot.Buffer->Tid = nextTid++;
+			slot.Buffer->Name = PendingName().empty() ? "thread " + to_string(slot.Buffer->Tid) : PendingName();
+			buffers.push_back(slot.Buffer);
+		}
+		return *slot.Buffer;
+	}
+
+	static atomic<unsigned int>& SampleEvery() {
+		static atomic<unsigned int> every(TRACE_SAMPLE_EVERY);
+		return every;
+	}
+
+	static void AppendJsonString(string& out, const char* text) {
+		out += '"';
+		for (const char* c = text; *c; c++) {
+			if (*c == '"' || *c == '\\') out += '\\';
+			if ((unsigned char)*c >= 0x20) out += *c;
+		}
+		out += '"';
+	}
+
+public:
+	static long long NowNs() {
+		return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// a new trace id if this request is sampled, otherwise 0
+	static unsigned long Sample() {
+		static atomic<unsigned long> requests(0);
+		unsigned int every = SampleEvery().load(memory_order_relaxed);
+		if (every == 0) return 0;
+		unsigned long n = requests.fetch_add(1, memory_order_relaxed);
+		return (n % every == 0) ? n / every + 1 : 0;
+	}
+
+	static void SetSampleEvery(unsigned int every) { SampleEvery() = every; }
+	static unsigned int GetSampleEvery() { return SampleEvery(); }
+
+	// the trace this thread is working for (0 = none)
+	static unsigned long Current() { return CurrentId(); }
+	static void SetCurrent(unsigned long id) { CurrentId() = id; }
+
+	// label this thread in the export; call before its first span
+	static void NameThread(const string& name) { PendingName() = name; }
+
+	// keep a finished span for the current trace
+	static void Record(const char* name, long long startNs, long long endNs, const char* detail = nullptr) {
+		RecordFor(CurrentId(), name, startNs, endNs, detail);
+	}
+
+	// keep a finished span for trace id, whatever this thread is working for
+	static void RecordFor(unsigned long id, const char* name, long long startNs, long long endNs, const char* detail = nullptr) {
+		if (id == 0) return;
+
+		ThreadBuffer& buffer = Buffer();
+		lock_guard<mutex> lock(buffer.Lock);
+		TraceSpan& span = buffer.Spans[buffer.Next++ % TRACE_SPANS_PER_THREAD];
+		span.Name = name;
+		span.TraceId = id;
+		span.StartNs = startNs;
+		span.EndNs = endNs;
+		span.Detail[0] = '\0';
+		if (detail) {
+			strncpy(span.Detail, detail, sizeof(span.Detail) - 1);
+			span.Detail[sizeof(span.Detail) - 1] = '\0';
+		}
+	}
+
+	// every kept span as Chrome trace JSON (chrome://tracing, Perfetto)
+	static string Export() {
+		vector<shared_ptr<ThreadBuffer>> buffers;
+		{
+			lock_guard<mutex> lock(RegistryLock());
+			buffers = Registry();
+		}
+
+		string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+		bool first = true;
+		char number[160];
+		for (auto& buffer : buffers) {
+			lock_guard<mutex> lock(buffer->Lock);
+			snprintf(number, sizeof(number), "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", first ? "" : ",", buffer->Tid);
+			out += number;
+			AppendJsonString(out, buffer->Name.c_str());
+			out += "}}";
+			first = false;
+
+			size_t count = buffer->Next < TRACE_SPANS_PER_THREAD ? buffer->Next : TRACE_SPANS_PER_THREAD;
+			for (size_t i = buffer->Next - count; i < buffer->Next; i++) {
+				const TraceSpan& span = buffer->Spans[i % TRACE_SPANS_PER_THREAD];
+				out += ",{\"ph\":\"X\",\"name\":";
+				AppendJsonString(out, span.Name);
+				snprintf(number, sizeof(number), ",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"trace\":%lu",
+					buffer->Tid, span.StartNs / 1000.0, (span.EndNs - span.StartNs) / 1000.0, span.TraceId);
+				out += number;
+				if (span.Detail[0]) {
+					out += ",\"detail\":";
+					AppendJsonString(out, span.Detail);
+				}
+				out += "}}";
+			}
+		}
+		out += "]}";
+		return out;
+	}
+
+	// drop every kept span
+	static void Clear() {
+		lock_guard<mutex> lock(RegistryLock());
+		for (auto& buffer : Registry()) {
+			lock_guard<mutex> bufferLock(buffer->Lock);
+			buffer->Next = 0;
+		}
+	}
+};
+
+// records the enclosing scope as a span of the trace current when it began
+class TraceScope
+{
+private:
+	const char* Name;
+	unsigned long Id;
+	long long StartNs;
+
+public:
+	TraceScope(const char* name) : Name(name) {
+		Id = Tracer::Current();
+		StartNs = Id ? Tracer::NowNs() : 0;
+	}
+
+	~TraceScope() {
+		if (Id) Tracer::RecordFor(Id, Name, StartNs, Tracer::NowNs());
+	}
+
+	TraceScope(const TraceScope&) = delete;
+	TraceScope& operator=(const TraceScope&) = delete;
+};
+
+// makes this thread work for trace id until the scope ends
+class TraceContext
+{
+private:
+	unsigned long Saved;
+
+public:
+	TraceContext(unsigned long id) {
+		Saved = Tracer::Current();
+		Tracer::SetCurrent(id);
+	}
+
+	~TraceContext() {
+		Tracer::SetCurrent(Saved);
+	}
+
+	TraceContext(const TraceContext&) = delete;
+	TraceContext& operator=(const TraceContext&) = delete;
+};
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>
+
+// compile-time wire layouts. a schema lists every field of a struct with its
+// byte offset on the wire; Encode/Decode expand to straight-line shifts with
+// no dependence on struct padding, bitfield order or host endianness.
+// multi-byte fields are little endian, which is what the robots expect.
+
+template<typename T> struct MemberOf;
+template<typename S, typename T> struct MemberOf<T S::*> {
+	typedef S Struct;
+	typedef T Type;
+};
+
+// a whole-byte field (1, 2 or 4 bytes) at a fixed offset
+template<size_t Offset, auto Member>
+struct WireField {
+	typedef typename MemberOf<decltype(Member)>::Struct Struct;
+	typedef typename MemberOf<decltype(Member)>::Type Type;
+	static constexpr size_t End = Offset + sizeof(Type);
+
+	static constexpr void Put(const Struct& src, unsigned char* out) {
+		for (size_t i = 0; i < sizeof(Type); i++) {
+			out[Offset + i] = (unsigned char)(src.*Member >> (8 * i));
+		}
+	}
+
+	static constexpr void Get(const unsigned char* in, Struct& dest) {
+		Type value = 0;
+		for (size_t i = 0; i < sizeof(Type); i++) {
+			value |= (Type)((Type)in[Offset + i] << (8 * i));
+		}
+		dest.*Member = value;
+	}
+};
+
+// Width bits starting at bit Shift of the byte at Offset
+template<size_t Offset, unsigned Shift, unsigned Width, auto Member>
+struct WireBits {
+	typedef typename MemberOf<decltype(Member)>::Struct Struct;
+	typedef typename MemberOf<decltype(Member)>::Type Type;
+	static constexpr size_t End = Offset + 1;
+	static constexpr unsigned Mask = (1u << Width) - 1;
+	static_assert(Shift + Width <= 8, "bit field must fit in one byte");
+
+	static constexpr void Put(const Struct& src, unsigned char* out) {
+		out[Offset] = (unsigned char)((out[Offset] & ~(Mask << Shift)) | ((src.*Member & Mask) << Shift));
+	}
+
+	static constexpr void Get(const unsigned char* in, Struct& dest) {
+		dest.*Member = (Type)((in[Offset] >> Shift) & Mask);
+	}
+};
+
+template<size_t A, size_t... Rest>
+constexpr size_t MaxOf() {
+	if constexpr (sizeof...(Rest) == 0) return A;
+	else return A > MaxOf<Rest...>() ? A : MaxOf<Rest...>();
+}
+
+// a struct's full wire layout
+template<typename S, typename... Fields>
+struct WireSchema {
+	static constexpr size_t Size = MaxOf<Fields::End...>();
+
+	// writes exactly Size bytes
+	static constexpr void Encode(const S& src, unsigned char* out) {
+		for (size_t i = 0; i < Size; i++) out[i] = 0;
+		(Fields::Put(src, out), ...);
+	}
+
+	// reads exactly Size bytes
+	static constexpr void Decode(const unsigned char* in, S& dest) {
+		(Fields::Get(in, dest), ...);
+	}
+};
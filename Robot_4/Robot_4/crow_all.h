@@ -9169,6 +9169,9 @@ namespace crow
         /// Call the after handle middleware and send the write the response to the connection.
         void complete_request()
         {
+            // when a handler ends the response asynchronously, the completion handler
+            // cleared in prepare_buffers() may hold the last reference to this connection
+            auto self = this->shared_from_this();
             CROW_LOG_INFO << "Response: " << this << ' ' << req_.raw_url << ' ' << res.code << ' ' << close_connection_;
             res.is_alive_helper_ = nullptr;
 
@@ -2,14 +2,177 @@
 #include "crow_all.h"
 #include "PktDef.h"
 #include "MySocket.h"
+#include "RobotLink.h"
+#include "TeleCommand.h"
+#include "HostResolver.h"
+#include "CommandScheduler.h"
+#include "HeartbeatMonitor.h"
+#include "RateLimiter.h"
+#include "RobotDiscovery.h"
+#include "Tracing.h"
 
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <charconv>
+#include <cstring>
 using namespace std;
 
-string robotIP = "127.0.0.1";
+string robotIP = "127.0.0.1";   // address or hostname of the current robot
 int robotPort = 5000;
+RobotLink::LinkOptions robotOptions = { false, -1, 0 };
 
-crow::SimpleApp app;
+// low-latency links spin a whole core, so /connect offers them only when the
+// server is started with --allow-lowlatency
+bool bAllowLowLatency = false;
+
+// robot hostnames, resolved in the background. declared before the links,
+// which watch it, so it is destroyed after them
+HostResolver resolver;
+
+// the connected robot's link, keyed by "ip:port". /connect retires it when it
+// switches robots or modes; shared, so handlers still holding it can finish
+map<string, shared_ptr<RobotLink>> robotLinks;
+mutex linksLock;
+
+// timed command plans. declared after the links so it stops before they go
+CommandScheduler scheduler;
+
+// pings quiet robots, likewise stopped before the links go
+HeartbeatMonitor heartbeat([] {
+    vector<shared_ptr<RobotLink>> links;
+    lock_guard<mutex> lock(linksLock);
+    for (auto& entry : robotLinks) links.push_back(entry.second);
+    return links;
+});
+
+// most steps accepted in one /plan
+#define PLAN_MAX_STEPS 256
+
+// /ws/control: each binary frame is one DriveBody, each answered with a 3 byte
+// binary ack: the frame's sequence number (little endian, counting from 1 per
+// connection) and one of these
+enum ControlAck {
+    ACK_OK,           // the robot acknowledged the drive
+    ACK_SUPERSEDED,   // a newer frame replaced it before it was sent
+    ACK_NO_RESPONSE,  // sent, but the robot did not answer
+    ACK_REJECTED,     // not a valid DriveBody
+    ACK_RATE_LIMITED  // over CONTROL_RATE, dropped
+};
+
+// /ws/control frames accepted per second per socket, comfortably above a 100 Hz joystick
+#define CONTROL_RATE 150
+#define CONTROL_BURST 30
+
+// one open control socket
+struct ControlSession {
+    unsigned long Id;
+    unsigned short LastSeq;
+    TokenBucket Frames;
+};
+
+// open control sockets by session id. acks arrive on the robot's sender thread,
+// maybe after the socket closed, so they only go to sessions still in here
+map<unsigned long, crow::websocket::connection*> controlConns;
+unsigned long nextControlId = 1;
+mutex controlLock;
+
+// points a /telemetry_history/ chart gets when it does not ask for a resolution
+#define HISTORY_POINTS 300
+
+// largest SO_BUSY_POLL budget /connect accepts (us)
+#define BUSY_POLL_MAX_US 10000
+
+// longest reply window a /discover may ask for (ms)
+#define DISCOVER_MAX_WAIT_MS 2000
+
+// scans allowed to run at once; each holds a thread for its whole window
+#define DISCOVER_MAX_SCANS 2
+atomic<int> discoverScans(0);
+
+// /ws/telemetry: the current robot's telemetry as binary TelemetryStream
+// frames (a keyframe, then deltas), one subscription per socket
+struct TelemetrySubscription {
+    weak_ptr<RobotLink> Link;
+    unsigned long Id;
+};
+
+// longest motion script accepted by /telecommand/batch
+#define BATCH_MAX_STEPS 64
+
+// /debug/trace: a sample rate under this is not accepted (1 traces every request)
+#define TRACE_SAMPLE_MAX 1000000
+
+// limits on robot-bound requests: per client address, and per robot across all clients
+#define CLIENT_RATE 20
+#define CLIENT_BURST 40
+#define ROBOT_RATE 50
+#define ROBOT_BURST 100
+
+// token buckets in front of every route that talks to a robot. a flood is
+// turned away with 429 here, before any body is parsed or packet queued
+struct RateLimit {
+    struct context {};
+
+    BucketTable<1024> Clients;
+    BucketTable<256> Robots;
+
+    static bool IsRobotBound(const crow::request& req) {
+        return req.url.rfind("/telecommand/", 0) == 0 || req.url == "/telementry_request/" ||
+            req.url == "/discover" || (req.url == "/plan/" && req.method == "POST"_method);
+    }
+
+    void before_handle(crow::request& req, crow::response& res, context&) {
+        if (!IsRobotBound(req)) return;
+
+        string robot;
+        {
+            lock_guard<mutex> lock(linksLock);
+            robot = robotIP + ":" + to_string(robotPort);
+        }
+        if (Clients.TryTake(req.remote_ip_address, CLIENT_RATE, CLIENT_BURST) && Robots.TryTake(robot, ROBOT_RATE, ROBOT_BURST)) return;
+
+        res.code = 429;
+        res.set_header("Retry-After", "1");
+        res.write("Too many requests");
+        res.end();
+    }
+
+    void after_handle(crow::request&, crow::response&, context&) {}
+};
+
+// samples requests for Tracer. a sampled request's id is made current on the
+// io thread, so anything the handler queues carries it to the robot's sender;
+// the whole request, routing included, is recorded as one "http" span. the id
+// is cleared when the response ends, so the next request starts untraced
+struct Tracing {
+    struct context {
+        unsigned long TraceId = 0;
+        long long StartNs = 0;
+    };
+
+    void before_handle(crow::request& req, crow::response&, context& ctx) {
+        ctx.TraceId = (req.url.rfind("/debug/", 0) == 0) ? 0 : Tracer::Sample();
+        Tracer::SetCurrent(ctx.TraceId);
+        if (ctx.TraceId) {
+            Tracer::NameThread("http io");
+            ctx.StartNs = Tracer::NowNs();
+        }
+    }
+
+    // may run later, on whichever thread ends the response
+    void after_handle(crow::request& req, crow::response&, context& ctx) {
+        Tracer::SetCurrent(0);
+        if (!ctx.TraceId) return;
+        string detail = crow::method_name(req.method) + " " + req.url;
+        Tracer::RecordFor(ctx.TraceId, "http", ctx.StartNs, Tracer::NowNs(), detail.c_str());
+    }
+};
+
+crow::App<Tracing, RateLimit> app;
 
 // this function reads the file contents
 string readFile(const string& path) {
@@ -22,72 +185,617 @@ string readFile(const string& path) {
     return "File not found";
 }
 
-// Send packet and get response (used by both telecommand & telemetry)
-string talkToRobot(PktDef& pkt) {
-    MySocket sock(CLIENT, robotIP, robotPort, UDP, 1024);
+// a whole decimal number and nothing else, as from_chars reads it
+template <typename T>
+bool parseInt(const char* text, T& out) {
+    const char* end = text + strlen(text);
+    from_chars_result res = from_chars(text, end, out);
+    return res.ec == errc() && res.ptr == end;
+}
+
+// get (or open) the link for the currently connected robot
+shared_ptr<RobotLink> currentLink() {
+    lock_guard<mutex> lock(linksLock);
+    string key = robotIP + ":" + to_string(robotPort);
+    shared_ptr<RobotLink>& link = robotLinks[key];
+    if (!link) link = make_shared<RobotLink>(robotIP, robotPort, robotOptions, &resolver);
+    return link;
+}
+
+// an async handler returns before its response ends, and so before after_handle
+// clears the trace id; one of these at the top of the handler clears it on return
+struct AsyncTrace {
+    ~AsyncTrace() { Tracer::SetCurrent(0); }
+};
 
-    char* data = pkt.GenPacket();
-    int size = HEADERSIZE + pkt.GetLength() + 1;
+// finish a response once the robot answers. the reply is posted back onto the
+// connection's io thread, so no worker sits blocked while the robot is busy
+RobotLink::ReplyHandler respondLater(const crow::request& req, crow::response& res) {
+    asio::io_service* io = req.io_service;
+    unsigned long trace = Tracer::Current();
+    return [io, &res, trace](const string& reply) {
+        io->post([&res, reply, trace] {
+            TraceContext context(trace);
+            TraceScope span("respond");
+            res.write(reply);
+            res.end();
+        });
+    };
+}
 
-    sock.SendData(data, size);
+// answer one /ws/control frame
+void sendControlAck(unsigned long session, unsigned short seq, ControlAck status) {
+    string ack = { (char)(seq & 0xFF), (char)(seq >> 8), (char)status };
+    lock_guard<mutex> lock(controlLock);
+    auto conn = controlConns.find(session);
+    if (conn != controlConns.end()) conn->second->send_binary(ack);
+}
 
-    char buffer[1024];
-    int len = sock.GetData(buffer);
+// turn work away from an overloaded robot link
+crow::response overloaded() {
+    crow::response res(503, "Robot link overloaded");
+    res.set_header("Retry-After", "1");
+    return res;
+}
 
-    return (len > 0) ? string("Robot replied: ") + string(buffer, len) : "No response";
+// summary of a latency histogram
+crow::json::wvalue latencyJson(const LatencyHistogram& hist) {
+    crow::json::wvalue out;
+    out["count"] = hist.GetCount();
+    out["mean_us"] = hist.GetMean();
+    out["p50_us"] = hist.GetPercentile(0.50);
+    out["p90_us"] = hist.GetPercentile(0.90);
+    out["p99_us"] = hist.GetPercentile(0.99);
+    out["max_us"] = hist.GetMax();
+    return out;
 }
 
-int main() {
+int main(int argc, char** argv) {
+    // --allow-lowlatency lets /connect put links in low-latency mode;
+    // --lock-memory locks the process into RAM (mlockall) so their senders never page fault
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--allow-lowlatency") bAllowLowLatency = true;
+        else if (arg == "--lock-memory") RobotLink::LockMemory();
+        else {
+            cerr << "ERROR: Unknown option " << arg << " (--allow-lowlatency, --lock-memory)" << endl;
+            return 1;
+        }
+    }
+
     // Serve GUI
     CROW_ROUTE(app, "/")([] {
         return crow::response(readFile("../public/index.html"));
         });
 
-    // Connect route (set IP/port)
+    // Connect route (set IP/port). the robot may be named by IPv4, IPv6 or hostname;
+    // a name is resolved in the background and the reply waits only for a first lookup.
+    // ?lowlatency=<cpu> pins the robot's link to that core in busy-polling mode,
+    // optionally with &busy_poll=<us> of SO_BUSY_POLL, if the server allows it;
+    // connecting without it returns the link to the default blocking mode
     CROW_ROUTE(app, "/connect/<string>/<int>").methods("POST"_method)
-        ([](const crow::request&, string ip, int port) {
-        robotIP = ip;
-        robotPort = port;
-        return crow::response("Connected to " + ip + ":" + to_string(port));
+        ([](const crow::request& req, crow::response& res, string ip, int port) {
+        RobotLink::LinkOptions options = { false, -1, 0 };
+        if (req.url_params.get("lowlatency")) {
+            if (!bAllowLowLatency) {
+                res.code = 403;
+                res.write("Low-latency mode is not enabled on this server (--allow-lowlatency)");
+                res.end();
+                return;
+            }
+            options.bLowLatency = true;
+            if (!parseInt(req.url_params.get("lowlatency"), options.Cpu) || !RobotLink::IsAllowedCpu(options.Cpu)) {
+                res.code = 400;
+                res.write("Invalid lowlatency (a CPU this server may run on)");
+                res.end();
+                return;
+            }
+            if (req.url_params.get("busy_poll") &&
+                (!parseInt(req.url_params.get("busy_poll"), options.BusyPollUs) || options.BusyPollUs < 0 || options.BusyPollUs > BUSY_POLL_MAX_US)) {
+                res.code = 400;
+                res.write("Invalid busy_poll (0-" + to_string(BUSY_POLL_MAX_US) + " us)");
+                res.end();
+                return;
+            }
+        }
+
+        asio::io_service* io = req.io_service;
+        resolver.Resolve(ip, [io, &res, ip, port, options](const vector<string>& addrs, const string& error) {
+            if (addrs.empty()) {
+                io->post([&res, ip, error] {
+                    res.code = 502;
+                    res.write("Could not resolve " + ip + ": " + error);
+                    res.end();
+                });
+                return;
+            }
+
+            vector<shared_ptr<RobotLink>> retired;
+            {
+                lock_guard<mutex> lock(linksLock);
+                robotIP = ip;
+                robotPort = port;
+                robotOptions = options;
+
+                // only this robot keeps a link, and only in this mode: a link's mode
+                // is fixed when its sender starts, so a change means a new link
+                string key = ip + ":" + to_string(port);
+                for (auto it = robotLinks.begin(); it != robotLinks.end();) {
+                    RobotLink::LinkOptions current = it->second->GetOptions();
+                    bool sameMode = current.bLowLatency == options.bLowLatency && current.Cpu == options.Cpu && current.BusyPollUs == options.BusyPollUs;
+                    if (it->first == key && sameMode) {
+                        ++it;
+                        continue;
+                    }
+                    retired.push_back(it->second);
+                    it = robotLinks.erase(it);
+                }
+            }
+            // a retired link shuts down (and fails anything still queued) once the last handler lets go
+            retired.clear();
+            string address = currentLink()->GetAddress();
+
+            string target = (address == ip) ? ip : ip + " (" + address + ")";
+            string mode = options.bLowLatency ? " (low latency, CPU " + to_string(options.Cpu) + ")" : "";
+            string reply = "Connected to " + target + ":" + to_string(port) + mode;
+            io->post([&res, reply] {
+                res.write(reply);
+                res.end();
+            });
+        });
             });
 
-    // Telecommand route (ex: "Forward,10")
+    // Robot discovery (ex: "/discover?range=192.168.1.0/24&port=5000&wait_ms=300").
+    // lists every robot that answers; /connect to one opens its link
+    CROW_ROUTE(app, "/discover").methods("GET"_method)
+        ([](const crow::request& req, crow::response& res) {
+        AsyncTrace untrace;
+        vector<struct in_addr> hosts;
+        const char* range = req.url_params.get("range");
+        if (!range || !RobotDiscovery::ParseRange(range, hosts)) {
+            res.code = 400;
+            res.write("Invalid range (a.b.c.d/n, at most " + to_string(DISCOVER_MAX_HOSTS) + " hosts)");
+            res.end();
+            return;
+        }
+        int port;
+        {
+            lock_guard<mutex> lock(linksLock);
+            port = robotPort;
+        }
+        if (req.url_params.get("port")) port = atoi(req.url_params.get("port"));
+        int waitMs = req.url_params.get("wait_ms") ? atoi(req.url_params.get("wait_ms")) : DISCOVER_WAIT_MS;
+        if (port <= 0 || port > 65535 || waitMs <= 0 || waitMs > DISCOVER_MAX_WAIT_MS) {
+            res.code = 400;
+            res.write("Invalid port or wait_ms");
+            res.end();
+            return;
+        }
+
+        if (++discoverScans > DISCOVER_MAX_SCANS) {
+            discoverScans--;
+            res.code = 503;
+            res.set_header("Retry-After", "1");
+            res.write("Too many scans running");
+            res.end();
+            return;
+        }
+
+        // the scan waits out its whole window, so it runs off the io threads
+        res.set_header("Content-Type", "application/json");
+        RobotLink::ReplyHandler reply = respondLater(req, res);
+        size_t probed = hosts.size();
+        thread([reply, hosts, port, waitMs, probed] {
+            vector<DiscoveredRobot> found = RobotDiscovery::Scan(hosts, port, waitMs);
+            discoverScans--;
+
+            crow::json::wvalue::list robots;
+            for (DiscoveredRobot& robot : found) {
+                crow::json::wvalue entry;
+                entry["address"] = robot.Address;
+                entry["port"] = robot.Port;
+                entry["rtt_us"] = robot.RttUs;
+                robots.push_back(move(entry));
+            }
+
+            crow::json::wvalue out;
+            out["probed"] = probed;
+            out["found"] = found.size();
+            out["robots"] = move(robots);
+            reply(out.dump());
+        }).detach();
+            });
+
+    // Telecommand route (ex: "Forward,10", or a raw DriveBody as application/octet-stream)
     CROW_ROUTE(app, "/telecommand/").methods("PUT"_method)
+        ([](const crow::request& req, crow::response& res) {
+        AsyncTrace untrace;
+        string_view body(req.body);
+        TeleCommand cmd;
+        ParseResult parsed;
+        {
+            TraceScope span("parse");
+            parsed = (req.get_header_value("Content-Type") == "application/octet-stream")
+                ? ParseDriveBody(body, cmd)
+                : ParseTeleCommand(body, cmd);
+        }
+
+        if (parsed != PARSE_OK) {
+            res.code = 400;
+            if (parsed == PARSE_BAD_DIRECTION) res.write("Invalid direction");
+            else if (parsed == PARSE_BAD_DURATION) res.write("Invalid duration");
+            else res.write("Malformed command");
+            res.end();
+            return;
+        }
+
+        if (cmd.Cmd == PktDef::SLEEP) {
+            // sleep jumps ahead of any queued drive/telemetry traffic
+            currentLink()->SubmitSleep(respondLater(req, res));
+            return;
+        }
+
+        // drives are latest-wins: queue it and return without waiting on the robot
+        RobotLink::DriveOutcome outcome = currentLink()->SubmitDrive(cmd.Body);
+        if (outcome == RobotLink::DRIVE_UNREACHABLE) {
+            res.code = 503;
+            res.set_header("Retry-After", "1");
+            res.write(UNREACHABLE_REPLY);
+        }
+        else {
+            res.code = 202;
+            res.write(outcome == RobotLink::DRIVE_SUPERSEDED ? "Drive command queued (replaced pending command)" : "Drive command queued");
+        }
+        res.end();
+            });
+
+    // Joystick control: binary DriveBody frames at up to ~100 Hz, latest-wins like
+    // PUT /telecommand/ but without a request per command. acks come back on the socket
+    CROW_WEBSOCKET_ROUTE(app, "/ws/control")
+        .onopen([](crow::websocket::connection& conn) {
+            ControlSession* session = new ControlSession();
+            conn.userdata(session);
+            lock_guard<mutex> lock(controlLock);
+            session->Id = nextControlId++;
+            controlConns[session->Id] = &conn;
+        })
+        .onclose([](crow::websocket::connection& conn, const string&) {
+            ControlSession* session = (ControlSession*)conn.userdata();
+            {
+                lock_guard<mutex> lock(controlLock);
+                controlConns.erase(session->Id);
+            }
+            delete session;
+        })
+        .onmessage([](crow::websocket::connection& conn, const string& data, bool isBinary) {
+            ControlSession* session = (ControlSession*)conn.userdata();
+            unsigned long id = session->Id;
+            unsigned short seq = ++session->LastSeq;
+
+            if (!session->Frames.TryTake(CONTROL_RATE, CONTROL_BURST)) {
+                sendControlAck(id, seq, ACK_RATE_LIMITED);
+                return;
+            }
+
+            TeleCommand cmd;
+            if (!isBinary || ParseDriveBody(data, cmd) != PARSE_OK) {
+                sendControlAck(id, seq, ACK_REJECTED);
+                return;
+            }
+
+            currentLink()->SubmitDrive(cmd.Body, [id, seq](const string& reply) {
+                ControlAck status = ACK_NO_RESPONSE;
+                if (reply.rfind("Robot replied", 0) == 0) status = ACK_OK;
+                else if (reply == "Superseded") status = ACK_SUPERSEDED;
+                sendControlAck(id, seq, status);
+            });
+        });
+
+    CROW_WEBSOCKET_ROUTE(app, "/ws/telemetry")
+        .onopen([](crow::websocket::connection& conn) {
+            shared_ptr<RobotLink> link = currentLink();
+            crow::websocket::connection* target = &conn;
+            unsigned long id = link->GetStream().Subscribe([target](const string& frame) { target->send_binary(frame); });
+            conn.userdata(new TelemetrySubscription{ link, id });
+        })
+        .onclose([](crow::websocket::connection& conn, const string&) {
+            // after Unsubscribe the stream never touches this connection again
+            TelemetrySubscription* subscription = (TelemetrySubscription*)conn.userdata();
+            shared_ptr<RobotLink> link = subscription->Link.lock();
+            if (link) link->GetStream().Unsubscribe(subscription->Id);
+            delete subscription;
+        })
+        .onmessage([](crow::websocket::connection&, const string&, bool) {});
+
+    // Motion script: a JSON array of telecommands, e.g. ["Forward,10","Left,2","Sleep"].
+    // All steps are encoded up front and pipelined to the robot; the reply lists each step's ack.
+    // a sleep sent meanwhile stops the script, and the steps it never sent come back preempted
+    CROW_ROUTE(app, "/telecommand/batch").methods("POST"_method)
+        ([](const crow::request& req, crow::response& res) {
+        AsyncTrace untrace;
+        crow::json::rvalue script = crow::json::load(req.body);
+        if (!script || script.t() != crow::json::type::List || script.size() == 0 || script.size() > BATCH_MAX_STEPS) {
+            res.code = 400;
+            res.write("Expected a JSON array of 1-" + to_string(BATCH_MAX_STEPS) + " commands");
+            res.end();
+            return;
+        }
+
+        vector<TeleCommand> steps(script.size());
+        for (size_t i = 0; i < script.size(); i++) {
+            string text = script[i].t() == crow::json::type::String ? string(script[i].s()) : "";
+            if (ParseTeleCommand(text, steps[i]) != PARSE_OK) {
+                res.code = 400;
+                res.write("Invalid command at step " + to_string(i));
+                res.end();
+                return;
+            }
+        }
+
+        shared_ptr<RobotLink> link = currentLink();
+        if (link->ShouldShed()) {
+            link->CountShed();
+            res = overloaded();
+            res.end();
+            return;
+        }
+
+        res.set_header("Content-Type", "application/json");
+        RobotLink::ReplyHandler reply = respondLater(req, res);
+        link->SubmitBatch(steps, [reply](const RobotLink::BatchResult& result) {
+            crow::json::wvalue out;
+            int acked = 0;
+            int preempted = 0;
+            for (size_t i = 0; i < result.Acked.size(); i++) {
+                out["steps"][i]["pkt_count"] = result.PktCounts[i];
+                out["steps"][i]["acked"] = (bool)result.Acked[i];
+                out["steps"][i]["preempted"] = (bool)result.Preempted[i];
+                if (result.Acked[i]) acked++;
+                if (result.Preempted[i]) preempted++;
+            }
+            out["total"] = result.Acked.size();
+            out["acked"] = acked;
+            out["preempted"] = preempted;
+            reply(out.dump());
+        });
+            });
+
+    // Round trip time distributions (microseconds) for every open robot link
+    CROW_ROUTE(app, "/rtt/").methods("GET"_method)
+        ([] {
+        crow::json::wvalue out;
+        lock_guard<mutex> lock(linksLock);
+        for (auto& entry : robotLinks) {
+            RobotLink& link = *entry.second;
+            out[entry.first]["kernel_timestamps"] = link.HasKernelTimestamps();
+            out[entry.first]["total"] = latencyJson(link.GetTotalRtt());
+            out[entry.first]["network"] = latencyJson(link.GetNetworkRtt());
+            out[entry.first]["gateway"] = latencyJson(link.GetGatewayRtt());
+        }
+        return crow::response(out);
+            });
+
+    // Command plan: {"start_in_ms":100,"steps":[{"at_ms":0,"cmd":"Forward,10"},{"at_ms":1500,"cmd":"Sleep"}]}.
+    // each step is sent to the current robot at_ms after the plan starts; returns the plan id
+    CROW_ROUTE(app, "/plan/").methods("POST"_method)
         ([](const crow::request& req) {
-        string cmd = req.body;
+        crow::json::rvalue body = crow::json::load(req.body);
+        if (!body || body.t() != crow::json::type::Object || !body.has("steps") || body["steps"].t() != crow::json::type::List ||
+            body["steps"].size() == 0 || body["steps"].size() > PLAN_MAX_STEPS) {
+            return crow::response(400, "Expected {\"steps\":[...]} with 1-" + to_string(PLAN_MAX_STEPS) + " steps");
+        }
 
-        if (cmd == "Sleep") {
-            PktDef pkt;
-            pkt.SetCmd(PktDef::SLEEP);
-            return crow::response(talkToRobot(pkt));
+        vector<PlanStep> steps(body["steps"].size());
+        for (size_t i = 0; i < steps.size(); i++) {
+            const crow::json::rvalue& step = body["steps"][i];
+            bool valid = step.t() == crow::json::type::Object && step.has("at_ms") && step["at_ms"].t() == crow::json::type::Number &&
+                step["at_ms"].i() >= 0 && step.has("cmd") && step["cmd"].t() == crow::json::type::String;
+            if (!valid || ParseTeleCommand(string(step["cmd"].s()), steps[i].Cmd) != PARSE_OK) {
+                return crow::response(400, "Invalid step " + to_string(i));
+            }
+            steps[i].AtMs = (unsigned int)step["at_ms"].i();
         }
 
-        // Assumes format like: "Forward,10"
-        string dirStr = cmd.substr(0, cmd.find(','));
-        int dur = stoi(cmd.substr(cmd.find(',') + 1));
+        unsigned int startInMs = 0;
+        if (body.has("start_in_ms") && body["start_in_ms"].t() == crow::json::type::Number && body["start_in_ms"].i() > 0) {
+            startInMs = (unsigned int)body["start_in_ms"].i();
+        }
 
-        char data[3];
-        if (dirStr == "Forward") data[0] = FORWARD;
-        else if (dirStr == "Backward") data[0] = BACKWARD;
-        else if (dirStr == "Left") data[0] = LEFT;
-        else if (dirStr == "Right") data[0] = RIGHT;
-        else return crow::response("Invalid direction");
+        shared_ptr<RobotLink> link = currentLink();
+        if (link->ShouldShed()) {
+            link->CountShed();
+            return overloaded();
+        }
 
-        data[1] = dur;
-        data[2] = 100; // Speed
+        crow::json::wvalue out;
+        out["plan"] = scheduler.Schedule(link, steps, startInMs);
+        crow::response res(out);
+        res.code = 202;
+        return res;
+            });
+
+    // Plan progress
+    CROW_ROUTE(app, "/plan/<int>").methods("GET"_method)
+        ([](int id) {
+        CommandScheduler::PlanProgress progress;
+        if (id <= 0 || !scheduler.GetProgress(id, progress)) return crow::response(404, "No such plan");
+
+        const char* states[] = { "pending", "running", "done", "cancelled" };
+        crow::json::wvalue out;
+        out["plan"] = progress.Id;
+        out["state"] = states[progress.State];
+        out["steps"] = progress.Steps;
+        out["dispatched"] = progress.Dispatched;
+        out["unreachable"] = progress.Unreachable;
+        out["sleeps_acked"] = progress.SleepsAcked;
+        out["mean_late_us"] = progress.MeanLateUs;
+        out["max_late_us"] = progress.MaxLateUs;
+        return crow::response(out);
+            });
 
-        PktDef pkt;
-        pkt.SetCmd(PktDef::DRIVE);
-        pkt.SetBodyData(data, 3);
-        return crow::response(talkToRobot(pkt));
+    // Cancel the steps of a plan that have not gone out yet
+    CROW_ROUTE(app, "/plan/<int>").methods("DELETE"_method)
+        ([](int id) {
+        if (id <= 0 || !scheduler.Cancel(id)) return crow::response(404, "No such running plan");
+        return crow::response("Plan " + to_string(id) + " cancelled");
             });
 
     // Telemetry request
+    // while the link is shedding load, a recent cached reading is served instead,
+    // its age in X-Telemetry-Age-Ms
     CROW_ROUTE(app, "/telementry_request/").methods("GET"_method)
+        ([](const crow::request& req, crow::response& res) {
+        AsyncTrace untrace;
+        shared_ptr<RobotLink> link = currentLink();
+        if (link->ShouldShed()) {
+            link->CountShed();
+            string cached;
+            long long ageMs;
+            if (link->GetCachedTelemetry(cached, ageMs)) {
+                res.set_header("X-Telemetry-Age-Ms", to_string(ageMs));
+                res.write(cached);
+            }
+            else {
+                res = overloaded();
+            }
+            res.end();
+            return;
+        }
+        link->SubmitTelemetry(respondLater(req, res));
+            });
+
+    // Telemetry history for charts (ex: "/telemetry_history/?from=<epoch s>&to=<epoch s>&resolution=60").
+    // robot=<ip:port> names the robot, 404 unless it is the connected one. readings come
+    // downsampled: min/max/avg/last per bucket, from the coarsest tier meeting resolution
+    CROW_ROUTE(app, "/telemetry_history/").methods("GET"_method)
+        ([](const crow::request& req) {
+        shared_ptr<RobotLink> link;
+        if (req.url_params.get("robot")) {
+            lock_guard<mutex> lock(linksLock);
+            auto found = robotLinks.find(req.url_params.get("robot"));
+            if (found != robotLinks.end()) link = found->second;
+        }
+        else {
+            link = currentLink();
+        }
+        if (!link) return crow::response(404, "Unknown robot");
+
+        // nothing is recorded before the epoch or after now, so to is capped at now
+        long long now = TelemetryRollup::NowS();
+        long long to = now;
+        if (req.url_params.get("to") && (!parseInt(req.url_params.get("to"), to) || to < 0)) return crow::response(400, "Invalid to");
+        if (to > now) to = now;
+        long long from = to > 3600 ? to - 3600 : 0;
+        if (req.url_params.get("from") && (!parseInt(req.url_params.get("from"), from) || from < 0)) return crow::response(400, "Invalid from");
+        if (from > to) return crow::response(400, "from is after to");
+        int resolution = (int)((to - from) / HISTORY_POINTS);
+        if (req.url_params.get("resolution") && (!parseInt(req.url_params.get("resolution"), resolution) || resolution <= 0)) {
+            return crow::response(400, "Invalid resolution");
+        }
+
+        vector<RollupBucket> buckets;
+        int width = link->GetRollup().Query(from, to, resolution, buckets);
+
+        crow::json::wvalue::list points;
+        for (const RollupBucket& bucket : buckets) {
+            crow::json::wvalue point;
+            point["t"] = bucket.StartS;
+            point["count"] = bucket.Count;
+            for (int f = 0; f < ROLLUP_FIELDS; f++) {
+                const FieldRollup& field = bucket.Fields[f];
+                const char* name = TelemetryRollup::FieldName(f);
+                point[name]["min"] = field.Min;
+                point[name]["max"] = field.Max;
+                point[name]["avg"] = (double)field.Sum / bucket.Count;
+                point[name]["last"] = field.Last;
+            }
+            points.push_back(move(point));
+        }
+
+        crow::json::wvalue out;
+        out["resolution_s"] = width;
+        out["points"] = move(points);
+        return crow::response(out);
+            });
+
+    // Queue statistics for the current robot link (wait times in microseconds)
+    CROW_ROUTE(app, "/link_stats/").methods("GET"_method)
         ([] {
-        PktDef pkt;
-        pkt.SetCmd(PktDef::RESPONSE);  // Or use pkt.SetTelemetryRequest() if defined
-        return crow::response(talkToRobot(pkt));
+        shared_ptr<RobotLink> link = currentLink();
+        const char* names[RobotLink::PRIORITY_COUNT] = { "high", "normal", "low" };
+
+        crow::json::wvalue stats;
+        stats["robot"] = link->GetIPAddr() + ":" + to_string(link->GetPort());
+        stats["address"] = link->GetAddress();
+        stats["low_latency"] = link->GetOptions().bLowLatency;
+        stats["drives_submitted"] = link->GetDrivesSubmitted();
+        stats["drives_sent"] = link->GetDrivesSent();
+        stats["drives_superseded"] = link->GetDrivesSuperseded();
+        stats["telemetry_requests"] = link->GetTelemetryRequests();
+        stats["telemetry_round_trips"] = link->GetTelemetryRoundTrips();
+        stats["in_flight"] = link->GetInFlight();
+        stats["smoothed_rtt_us"] = link->GetRtt().GetSrtt();
+        stats["rtt_var_us"] = link->GetRtt().GetRttVar();
+        stats["reply_timeout_ms"] = link->GetRtt().GetRtoMs();
+        stats["alive"] = link->IsAlive();
+        stats["silent_ms"] = link->GetSilentMs();
+        stats["heartbeats"] = link->GetHeartbeats();
+        stats["stream_subscribers"] = link->GetStream().GetSubscribers();
+        stats["stream_frames"] = link->GetStream().GetFramesSent();
+        stats["stream_bytes"] = link->GetStream().GetBytesSent();
+        stats["captured_packets"] = link->GetCapture().GetRecorded();
+        stats["shedding"] = link->ShouldShed();
+        stats["shed"] = link->GetShed();
+        const char* breakerNames[] = { "closed", "open", "half_open" };
+        stats["breaker"] = breakerNames[link->GetBreakerState()];
+        stats["breaker_trips"] = link->GetBreakerTrips();
+        stats["failed_fast"] = link->GetFailedFast();
+        for (int i = 0; i < RobotLink::PRIORITY_COUNT; i++) {
+            RobotLink::LaneStats lane = link->GetLaneStats((RobotLink::Priority)i);
+            stats[names[i]]["count"] = lane.Count;
+            stats[names[i]]["avg_wait_us"] = lane.Count ? lane.TotalWaitUs / lane.Count : 0.0;
+            stats[names[i]]["max_wait_us"] = lane.MaxWaitUs;
+        }
+        return crow::response(stats);
+            });
+
+    // Spans of sampled requests as Chrome trace JSON, for chrome://tracing or Perfetto.
+    // sample=<n> traces one request in n from now on (0 stops tracing); clear=1 drops what was kept
+    CROW_ROUTE(app, "/debug/trace").methods("GET"_method)
+        ([](const crow::request& req) {
+        if (req.url_params.get("sample")) {
+            int every = atoi(req.url_params.get("sample"));
+            if (every < 0 || every > TRACE_SAMPLE_MAX) return crow::response(400, "Invalid sample");
+            Tracer::SetSampleEvery((unsigned int)every);
+        }
+
+        crow::response res(Tracer::Export());
+        res.set_header("Content-Type", "application/json");
+        res.set_header("X-Trace-Sample-Every", to_string(Tracer::GetSampleEvery()));
+        if (req.url_params.get("clear")) Tracer::Clear();
+        return res;
+            });
+
+    // The last packets exchanged with a robot as a pcap file for Wireshark (ex: "/debug/pcap?robot=10.0.0.5:5000").
+    // robot=<ip:port> names the robot, 404 unless it is the connected one
+    CROW_ROUTE(app, "/debug/pcap").methods("GET"_method)
+        ([](const crow::request& req) {
+        shared_ptr<RobotLink> link;
+        if (req.url_params.get("robot")) {
+            lock_guard<mutex> lock(linksLock);
+            auto found = robotLinks.find(req.url_params.get("robot"));
+            if (found != robotLinks.end()) link = found->second;
+        }
+        else {
+            link = currentLink();
+        }
+        if (!link) return crow::response(404, "Unknown robot");
+
+        string name = link->GetIPAddr() + "_" + to_string(link->GetPort()) + ".pcap";
+        crow::response res(PacketCapture::ToPcap(link->GetCapture().Snapshot(), link->GetCaptureEndpoints()));
+        res.set_header("Content-Type", "application/vnd.tcpdump.pcap");
+        res.set_header("Content-Disposition", "attachment; filename=\"" + name + "\"");
+        return res;
             });
 
     app.port(18080).run();